@@ -1,113 +1,595 @@
 #include <inc/memlayout.h>
 #include <kern/kheap.h>
 #include <kern/memory_manager.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/environment_definitions.h>
+#include <kern/user_environment.h>
+#include <kern/trap.h>
 
 //NOTE: All kernel heap allocations are multiples of PAGE_SIZE (4KB)
+//		small kernel objects should use the object caches (kmem_cache_*) below instead
 
 #define KERNEL_HEAP_SIZE (KERNEL_HEAP_MAX - KERNEL_HEAP_START)
-uint32 allocation_counter = 0; //For indexing: allocated_mem[]
-struct AllocatedMemory
+#define KHEAP_NUM_PAGES (KERNEL_HEAP_SIZE/PAGE_SIZE)
+//The kernel heap VA of each heap frame is kept in its Frame_Info "va" (back-pointer).
+//"va" is otherwise only used for buffered user pages (below USER_TOP) and is cleared by
+//free_frame(), so a value inside [KERNEL_HEAP_START, KERNEL_HEAP_MAX) identifies a heap frame.
+#define KH_IS_HEAP_VA(va) ((va) >= KERNEL_HEAP_START && (va) < KERNEL_HEAP_MAX)
+
+//=================================================================================//
+//============================ FREE EXTENTS INDEX =================================//
+//=================================================================================//
+//Every free range of kernel heap pages (free extent) is indexed by its first page:
+//	a) in an address-ordered treap, each node keeps the max extent size in its subtree
+//	   (used by FIRST FIT, NEXT FIT and WORST FIT)
+//	b) in a bucket of extents of the same size, with a 2-level bitmap of the non-empty buckets
+//	   (used by BEST FIT)
+//Page indices are relative to KERNEL_HEAP_START and fit in 16 bits (KHEAP_NUM_PAGES < 0xFFFF)
+
+#define KH_NIL 0xFFFF
+#define KH_PAGE_INDEX(va) (((uint32)(va) - KERNEL_HEAP_START)/PAGE_SIZE)
+#define KH_PAGE_VA(index) (KERNEL_HEAP_START + (uint32)(index)*PAGE_SIZE)
+#define KH_SIZE_WORDS ((KHEAP_NUM_PAGES + 1 + 31)/32)
+#define KH_SUMMARY_WORDS ((KH_SIZE_WORDS + 31)/32)
+
+int kh_initialized = 0;
+uint32 kh_next_fit_index = 0;	//where the NEXT FIT search starts from
+
+uint16 free_extent_size[KHEAP_NUM_PAGES];	//num of pages if the page starts a free extent, 0 otherwise
+uint16 free_extent_head[KHEAP_NUM_PAGES];	//for the last page of a free extent: its first page
+
+uint16 extent_left[KHEAP_NUM_PAGES], extent_right[KHEAP_NUM_PAGES];
+uint16 extent_max[KHEAP_NUM_PAGES];
+uint16 extent_root = KH_NIL;
+
+uint16 size_bucket_head[KHEAP_NUM_PAGES + 1];
+uint16 extent_bucket_next[KHEAP_NUM_PAGES], extent_bucket_prev[KHEAP_NUM_PAGES];
+uint32 size_bitmap[KH_SIZE_WORDS];
+uint32 size_summary[KH_SUMMARY_WORDS];
+
+static inline uint32 kh_priority(uint32 index) { return index * 2654435761u; }
+
+static inline uint32 kh_lowest_bit(uint32 bits)
 {
-	uint32 virtual_address;
-	uint32 allocated_pages;
-}allocated_mem[KERNEL_HEAP_SIZE/PAGE_SIZE + 1];
+	uint32 bit = 0;
+	while(!(bits & 1)) { bits >>= 1; bit++; }
+	return bit;
+}
 
-//using frame number
-uint32 va_retrieval[(1<<20) + 1];
+static inline void kh_update(uint16 t)
+{
+	uint16 max = free_extent_size[t];
+	if(extent_left[t] != KH_NIL && extent_max[extent_left[t]] > max)
+		max = extent_max[extent_left[t]];
+	if(extent_right[t] != KH_NIL && extent_max[extent_right[t]] > max)
+		max = extent_max[extent_right[t]];
+	extent_max[t] = max;
+}
 
-void* kmalloc(unsigned int size)
+static uint16 kh_merge(uint16 l, uint16 r)
 {
-	//TODO: [PROJECT 2019 - MS1 - [1] Kernel Heap] kmalloc()
-	uint32 required_num_pages = size/PAGE_SIZE + (size % PAGE_SIZE != 0);
+	if(l == KH_NIL) return r;
+	if(r == KH_NIL) return l;
+	if(kh_priority(l) > kh_priority(r)) {
+		extent_right[l] = kh_merge(extent_right[l], r);
+		kh_update(l);
+		return l;
+	}
+	extent_left[r] = kh_merge(l, extent_left[r]);
+	kh_update(r);
+	return r;
+}
 
-	uint32 allocation_va = -1, best_allocation = KERNEL_HEAP_SIZE/PAGE_SIZE + 1;
+//Split "t" into extents starting before "index" (l) and at/after it (r)
+static void kh_split(uint16 t, uint32 index, uint16 *l, uint16 *r)
+{
+	if(t == KH_NIL) {
+		*l = *r = KH_NIL;
+		return;
+	}
+	if(t < index) {
+		kh_split(extent_right[t], index, &extent_right[t], r);
+		*l = t;
+	}
+	else {
+		kh_split(extent_left[t], index, l, &extent_left[t]);
+		*r = t;
+	}
+	kh_update(t);
+}
 
-	uint32 *ptr_table;
-	struct Frame_Info* ptr_frame_info;
+static inline void kh_size_mark(uint32 size)
+{
+	size_bitmap[size/32] |= (1u << (size%32));
+	size_summary[size/1024] |= (1u << ((size/32)%32));
+}
 
-	uint32 consecutive_pages = 0, tmp_start = -1;
-	for(uint32 va = KERNEL_HEAP_START ; va < KERNEL_HEAP_MAX ; va += PAGE_SIZE) {
-		ptr_frame_info = get_frame_info(ptr_page_directory, (void *)va, &ptr_table);
-		//The VA is mapped
-		if(ptr_frame_info != NULL) {
-			if(consecutive_pages >= required_num_pages && best_allocation > consecutive_pages) {
-				allocation_va = tmp_start;
-				best_allocation = consecutive_pages;
-			}
-			tmp_start = -1;
-			consecutive_pages = 0;
-			continue;
+static inline void kh_size_unmark(uint32 size)
+{
+	size_bitmap[size/32] &= ~(1u << (size%32));
+	if(size_bitmap[size/32] == 0)
+		size_summary[size/1024] &= ~(1u << ((size/32)%32));
+}
+
+//Smallest size >= "size" having at least one free extent, 0 if none
+static uint32 kh_smallest_size_from(uint32 size)
+{
+	uint32 word = size/32;
+	uint32 bits = size_bitmap[word] & (0xFFFFFFFF << (size%32));
+	if(bits)
+		return word*32 + kh_lowest_bit(bits);
+
+	if(++word >= KH_SIZE_WORDS)
+		return 0;
+	uint32 s = word/32;
+	uint32 summary = size_summary[s] & (0xFFFFFFFF << (word%32));
+	while(!summary) {
+		if(++s >= KH_SUMMARY_WORDS)
+			return 0;
+		summary = size_summary[s];
+	}
+	word = s*32 + kh_lowest_bit(summary);
+	return word*32 + kh_lowest_bit(size_bitmap[word]);
+}
+
+static void kh_insert_free_extent(uint32 start, uint32 num_pages)
+{
+	free_extent_size[start] = num_pages;
+	free_extent_head[start + num_pages - 1] = start;
+
+	extent_bucket_prev[start] = KH_NIL;
+	extent_bucket_next[start] = size_bucket_head[num_pages];
+	if(size_bucket_head[num_pages] != KH_NIL)
+		extent_bucket_prev[size_bucket_head[num_pages]] = start;
+	size_bucket_head[num_pages] = start;
+	kh_size_mark(num_pages);
+
+	uint16 l, r;
+	extent_left[start] = extent_right[start] = KH_NIL;
+	kh_update(start);
+	kh_split(extent_root, start, &l, &r);
+	extent_root = kh_merge(kh_merge(l, start), r);
+}
+
+static void kh_remove_free_extent(uint32 start)
+{
+	uint32 num_pages = free_extent_size[start];
+
+	if(extent_bucket_prev[start] != KH_NIL)
+		extent_bucket_next[extent_bucket_prev[start]] = extent_bucket_next[start];
+	else
+		size_bucket_head[num_pages] = extent_bucket_next[start];
+	if(extent_bucket_next[start] != KH_NIL)
+		extent_bucket_prev[extent_bucket_next[start]] = extent_bucket_prev[start];
+	if(size_bucket_head[num_pages] == KH_NIL)
+		kh_size_unmark(num_pages);
+
+	uint16 l, m, r;
+	kh_split(extent_root, start, &l, &m);
+	kh_split(m, start + 1, &m, &r);
+	extent_root = kh_merge(l, r);
+
+	free_extent_size[start] = 0;
+}
+
+//Return the pages [start, start + num_pages) to the index, coalescing with the free neighbours
+static void kh_release_range(uint32 start, uint32 num_pages)
+{
+	if(start > 0) {
+		uint32 prev = free_extent_head[start - 1];
+		if(free_extent_size[prev] != 0 && prev + free_extent_size[prev] == start) {
+			num_pages += free_extent_size[prev];
+			kh_remove_free_extent(prev);
+			start = prev;
 		}
-		if(!consecutive_pages) //Fresh start on a new free range
-			tmp_start = va;
-		consecutive_pages++;
 	}
-	//Last Check
-	if(consecutive_pages >= required_num_pages && best_allocation > consecutive_pages) {
-		allocation_va = tmp_start;
-		best_allocation = consecutive_pages;
+	uint32 next = start + num_pages;
+	if(next < KHEAP_NUM_PAGES && free_extent_size[next] != 0) {
+		num_pages += free_extent_size[next];
+		kh_remove_free_extent(next);
 	}
-	if(allocation_va == -1) return (void*)NULL; //No suitable address was found
+	kh_insert_free_extent(start, num_pages);
+}
+
+//=================================================================================//
+//============================ ALLOCATIONS TABLE ==================================//
+//=================================================================================//
+//Radix table indexed by the first page of each allocation (relative to KERNEL_HEAP_START):
+//holds the allocation size in pages, 0 if no allocation starts at this page.
+//Insert, lookup and delete are O(1) with no compaction.
+uint16 allocated_pages[KHEAP_NUM_PAGES];
 
-	for(uint32 i=0, va = allocation_va ; i < required_num_pages ; i++, va += PAGE_SIZE) {
-		ptr_frame_info = get_frame_info(ptr_page_directory, (void *)va, &ptr_table);
-		int result;
-		if(ptr_frame_info == NULL)
-			result = allocate_frame(&ptr_frame_info);
+//Pages reserved by kmalloc_lazy() (mapped or not yet), their frames are mapped on first touch
+uint32 lazy_pages_bitmap[(KHEAP_NUM_PAGES + 31)/32];
+#define KH_IS_LAZY(index) (lazy_pages_bitmap[(index)/32] & (1u << ((index)%32)))
 
-		if(result == E_NO_MEM){
-			cprintf("FAILED, no physical memory available.\n");
-			return (void*)NULL;
+static void kh_set_lazy(uint32 start, uint32 num_pages, uint8 lazy)
+{
+	for(uint32 index = start; index < start + num_pages; index++) {
+		if(lazy)
+			lazy_pages_bitmap[index/32] |= (1u << (index%32));
+		else
+			lazy_pages_bitmap[index/32] &= ~(1u << (index%32));
+	}
+}
+
+//Num of pages of the allocation starting at "virtual_address", 0 if it's not an allocation start
+static inline uint32 kh_allocation_size(void* virtual_address)
+{
+	uint32 va = (uint32)virtual_address;
+	if(va < KERNEL_HEAP_START || va >= KERNEL_HEAP_MAX || va % PAGE_SIZE != 0)
+		return 0;
+	return allocated_pages[KH_PAGE_INDEX(va)];
+}
+
+//Num of free pages right after the allocation of "num_pages" pages starting at page "start"
+static inline uint32 kh_free_pages_after(uint32 start, uint32 num_pages)
+{
+	uint32 next = start + num_pages;
+	if(next >= KHEAP_NUM_PAGES)
+		return 0;
+	return free_extent_size[next];
+}
+
+//=================================================================================//
+//=========================== 4MB LARGE PAGES (PSE) ===============================//
+//=================================================================================//
+//Each 4MB-aligned span fully covered by a kmalloc() allocation is mapped by a single PSE
+//directory entry when 1024 physically contiguous (4MB-aligned) frames are available.
+//The (empty) boot page table of that span is kept aside and put back when the span is unmapped.
+
+#define KH_PAGES_PER_TABLE 1024
+#define KH_TABLE_SIZE (KH_PAGES_PER_TABLE*PAGE_SIZE)
+#define KH_IS_LARGE(va) (ptr_page_directory[PDX(va)] & PERM_LARGE_PAGE)
+#define KH_TABLE_INDEX(va) (PDX(va) - PDX(KERNEL_HEAP_START))
+
+uint32 kh_saved_tables[(KHEAP_NUM_PAGES + KH_PAGES_PER_TABLE - 1)/KH_PAGES_PER_TABLE];
+
+#define KH_LARGE_PAGE_ORDER 10	//a large page is a block of 2^10 frames of the buddy frame allocator
+
+extern int allocate_frames(uint32 order, struct Frame_Info **ptr_frame_info);
+extern void free_frames(struct Frame_Info *ptr_frame_info, uint32 order);
+extern uint16* page_table_live_entries;
+
+//Set the directory entry of "va" in the kernel directory and in the directory of every env,
+//since envs copy the kernel entries when they are created
+static void kh_set_kernel_pde(uint32 va, uint32 entry)
+{
+	ptr_page_directory[PDX(va)] = entry;
+	for(int i = 0; i < NENV; i++)
+	{
+		if(envs[i].env_status != ENV_FREE && envs[i].env_page_directory != NULL)
+			envs[i].env_page_directory[PDX(va)] = entry;
+	}
+	tlbflush();
+}
+
+//Map the 4MB span starting at "va" by one large page
+//Return 0 on success, E_NO_MEM if no 1024 contiguous aligned frames are available
+static int kh_map_large_page(uint32 va)
+{
+	struct Frame_Info *first_frame;
+	if(allocate_frames(KH_LARGE_PAGE_ORDER, &first_frame) != 0)
+		return E_NO_MEM;
+	for(uint32 i = 0; i < KH_PAGES_PER_TABLE; i++) {
+		first_frame[i].references = 1;
+		first_frame[i].va = va + i*PAGE_SIZE;
+	}
+
+	lcr4(rcr4() | CR4_PSE_ENABLE);
+	kh_saved_tables[KH_TABLE_INDEX(va)] = ptr_page_directory[PDX(va)];
+	kh_set_kernel_pde(va, CONSTRUCT_ENTRY(to_physical_address(first_frame), PERM_LARGE_PAGE|PERM_WRITEABLE|PERM_PRESENT));
+	return 0;
+}
+
+//Free the frames of the large page at "va" and put its page table back
+static void kh_unmap_large_page(uint32 va)
+{
+	struct Frame_Info *first_frame = to_frame_info(EXTRACT_ADDRESS(ptr_page_directory[PDX(va)]));
+	kh_set_kernel_pde(va, kh_saved_tables[KH_TABLE_INDEX(va)]);
+	free_frames(first_frame, KH_LARGE_PAGE_ORDER);
+}
+
+//Demote the large page at "va" to 1024 entries of its page table, keeping the same frames
+static void kh_demote_large_page(uint32 va)
+{
+	uint32 large_entry = ptr_page_directory[PDX(va)];
+	uint32 table_entry = kh_saved_tables[KH_TABLE_INDEX(va)];
+	uint32 *ptr_page_table = STATIC_KERNEL_VIRTUAL_ADDRESS(EXTRACT_ADDRESS(table_entry));
+	for(uint32 i = 0; i < KH_PAGES_PER_TABLE; i++)
+		ptr_page_table[i] = CONSTRUCT_ENTRY(EXTRACT_ADDRESS(large_entry) + i*PAGE_SIZE, PERM_WRITEABLE|PERM_PRESENT);
+	//(the saved table was empty: all of its entries are used now, see set_page_table_entry())
+	page_table_live_entries[EXTRACT_ADDRESS(table_entry) / PAGE_SIZE] = KH_PAGES_PER_TABLE;
+	kh_set_kernel_pde(va, table_entry);
+}
+
+//Demote every large page overlapping the "num_pages" pages starting at "va"
+static void kh_demote_range(uint32 va, uint32 num_pages)
+{
+	//walk by directory index: the last span of the heap ends at the top of the address space
+	for(uint32 pdx = PDX(va); pdx <= PDX(va + num_pages*PAGE_SIZE - 1); pdx++)
+		if(ptr_page_directory[pdx] & PERM_LARGE_PAGE)
+			kh_demote_large_page(pdx*KH_TABLE_SIZE);
+}
+
+//Take the first "num_pages" pages of the free extent starting at page "start"
+static void kh_take_pages(uint32 start, uint32 num_pages)
+{
+	uint32 extent_pages = free_extent_size[start];
+	kh_remove_free_extent(start);
+	if(extent_pages > num_pages)
+		kh_insert_free_extent(start + num_pages, extent_pages - num_pages);
+}
+
+//Frames of the page table being mapped by kh_map_pages()
+struct Frame_Info *kh_frames[KH_PAGES_PER_TABLE];
+
+extern int map_frame_range(uint32 *ptr_page_directory, struct Frame_Info **ptr_frames, uint32 virtual_address, uint32 num_pages, int perm);
+extern void unmap_frame_range(uint32 *ptr_page_directory, uint32 virtual_address, uint32 num_pages);
+
+extern int allocate_zeroed_frame(struct Frame_Info **ptr_frame_info);
+
+//Allocate and map a frame for each of the "num_pages" pages starting at "va", one page table at a time
+//(a large page for each 4MB-aligned span when possible, except for "zeroed" pages which take
+//their frames from the pre-zeroed pool)
+//Return 0 on success, E_NO_MEM (after unmapping what was mapped) on failure
+static void kh_unmap_pages(uint32 va, uint32 num_pages);
+static int kh_map_pages(uint32 va, uint32 num_pages, uint8 zeroed)
+{
+	uint32 i = 0;
+	while(i < num_pages) {
+		uint32 chunk_va = va + i*PAGE_SIZE;
+		uint32 chunk_pages = KH_PAGES_PER_TABLE - PTX(chunk_va);
+		if(chunk_pages > num_pages - i)
+			chunk_pages = num_pages - i;
+		if(!zeroed && chunk_pages == KH_PAGES_PER_TABLE && kh_map_large_page(chunk_va) == 0) {
+			i += chunk_pages;
+			continue;
 		}
 
-		result = map_frame(ptr_page_directory, ptr_frame_info, (void*)va, PERM_WRITEABLE|PERM_PRESENT);
-		if(result != 0){
+		uint32 j;
+		for(j = 0; j < chunk_pages; j++) {
+			int result = zeroed ? allocate_zeroed_frame(&kh_frames[j]) : allocate_frame(&kh_frames[j]);
+			if(result == E_NO_MEM)
+				break;
+			kh_frames[j]->va = chunk_va + j*PAGE_SIZE;
+		}
+		if(j < chunk_pages){
+			cprintf("FAILED, no physical memory available.\n");
+		}
+		else if(map_frame_range(ptr_page_directory, kh_frames, chunk_va, chunk_pages, PERM_WRITEABLE|PERM_PRESENT) != 0){
 			cprintf("FAILED, no page table found and theres no free frame for creating it.\n");
-			free_frame(ptr_frame_info);
-			return (void*)NULL;
 		}
-		uint32 PA = to_physical_address(ptr_frame_info);
-		uint32 frame_number = PA/PAGE_SIZE;
-		va_retrieval[frame_number] = va;
+		else {
+			i += chunk_pages;
+			continue;
+		}
+		while(j > 0)
+			free_frame(kh_frames[--j]);
+		kh_unmap_pages(va, i);
+		return E_NO_MEM;
+	}
+	return 0;
+}
+
+//Unmap the "num_pages" pages starting at "va" and free their frames
+//(large pages fully in the range are freed as a whole, the others are demoted first)
+static void kh_unmap_pages(uint32 va, uint32 num_pages)
+{
+	for(uint32 i = 0; i < num_pages; ) {
+		uint32 chunk_va = va + i*PAGE_SIZE;
+		uint32 chunk_pages = KH_PAGES_PER_TABLE - PTX(chunk_va);
+		if(chunk_pages > num_pages - i)
+			chunk_pages = num_pages - i;
+		if(KH_IS_LARGE(chunk_va)) {
+			if(chunk_pages == KH_PAGES_PER_TABLE)
+				kh_unmap_large_page(chunk_va);
+			else
+				kh_demote_large_page(ROUNDDOWN(chunk_va, KH_TABLE_SIZE));
+		}
+		i += chunk_pages;
+	}
+	unmap_frame_range(ptr_page_directory, va, num_pages);
+}
+
+//Move the frames mapped at the "num_pages" pages starting at "va" to the pages starting at "new_va"
+//by remapping them one run of present pages at a time (lazy pages not touched yet are skipped)
+//Return 0 on success, E_NO_MEM (after moving back what was moved) if a page table can't be created
+static int kh_move_pages(uint32 va, uint32 new_va, uint32 num_pages)
+{
+	uint32 *ptr_table;
+	uint32 i = 0;
+	while(i < num_pages) {
+		uint32 run = 0;
+		while(i + run < num_pages && run < KH_PAGES_PER_TABLE) {
+			struct Frame_Info *ptr_frame_info = get_frame_info(ptr_page_directory, (void*)(va + (i + run)*PAGE_SIZE), &ptr_table);
+			if(ptr_frame_info == NULL)
+				break;
+			kh_frames[run++] = ptr_frame_info;
+		}
+		if(run == 0) {
+			i++;
+			continue;
+		}
+		//map first so that the references never reach 0
+		if(map_frame_range(ptr_page_directory, kh_frames, new_va + i*PAGE_SIZE, run, PERM_WRITEABLE|PERM_PRESENT) != 0) {
+			kh_move_pages(new_va, va, i);
+			return E_NO_MEM;
+		}
+		unmap_frame_range(ptr_page_directory, va + i*PAGE_SIZE, run);
+		for(uint32 j = 0; j < run; j++)
+			kh_frames[j]->va = new_va + (i + j)*PAGE_SIZE;
+		i += run;
 	}
-	allocated_mem[allocation_counter].allocated_pages = required_num_pages;
-	allocated_mem[allocation_counter].virtual_address = allocation_va;
-	allocation_counter++;
+	return 0;
+}
+
+static void kh_initialize()
+{
+	for(uint32 i = 0; i <= KHEAP_NUM_PAGES; i++)
+		size_bucket_head[i] = KH_NIL;
+	kh_insert_free_extent(0, KHEAP_NUM_PAGES);
+	kh_initialized = 1;
+}
+
+//Leftmost extent starting at/after "from" with at least "num_pages" pages
+static uint16 kh_first_fit_from(uint16 t, uint32 from, uint32 num_pages)
+{
+	if(t == KH_NIL || extent_max[t] < num_pages)
+		return KH_NIL;
+	if(t < from)
+		return kh_first_fit_from(extent_right[t], from, num_pages);
+
+	uint16 found = kh_first_fit_from(extent_left[t], from, num_pages);
+	if(found != KH_NIL)
+		return found;
+	if(free_extent_size[t] >= num_pages)
+		return t;
+	return kh_first_fit_from(extent_right[t], from, num_pages);
+}
+
+//Return the first page of the free extent chosen by the current placement strategy, KH_NIL if none
+static uint32 kh_find_free_extent(uint32 num_pages)
+{
+	if(extent_root == KH_NIL || extent_max[extent_root] < num_pages)
+		return KH_NIL;
+
+	if(isKHeapPlacementStrategyFIRSTFIT())
+		return kh_first_fit_from(extent_root, 0, num_pages);
+
+	if(isKHeapPlacementStrategyNEXTFIT()) {
+		uint16 found = kh_first_fit_from(extent_root, kh_next_fit_index, num_pages);
+		if(found == KH_NIL)
+			found = kh_first_fit_from(extent_root, 0, num_pages);
+		return found;
+	}
+
+	if(isKHeapPlacementStrategyWORSTFIT()) {
+		uint16 t = extent_root, max = extent_max[extent_root];
+		while(free_extent_size[t] != max) {
+			if(extent_left[t] != KH_NIL && extent_max[extent_left[t]] == max)
+				t = extent_left[t];
+			else
+				t = extent_right[t];
+		}
+		return t;
+	}
+
+	//BEST FIT (default)
+	uint32 size = kh_smallest_size_from(num_pages);
+	if(size == 0)
+		return KH_NIL;
+	return size_bucket_head[size];
+}
+
+//Reserve the VA range of a new allocation of "num_pages" pages starting on an "align_pages" boundary,
+//return its first page (KH_NIL if none)
+static uint32 kh_reserve(uint32 num_pages, uint32 align_pages)
+{
+	if(!kh_initialized)
+		kh_initialize();
 
 	//TODO: [PROJECT 2019 - BONUS1] Implement the FIRST FIT strategy for Kernel allocation
 	// Beside the BEST FIT
 	// use "isKHeapPlacementStrategyFIRSTFIT() ..." functions to check the current strategy
+	uint32 extent_start = kh_find_free_extent(num_pages + align_pages - 1);
+	if(extent_start == KH_NIL)
+		return KH_NIL;
+
+	uint32 extent_pages = free_extent_size[extent_start];
+	uint32 start = ROUNDUP(extent_start, align_pages);
+	kh_remove_free_extent(extent_start);
+	if(start > extent_start)
+		kh_insert_free_extent(extent_start, start - extent_start);
+	if(extent_start + extent_pages > start + num_pages)
+		kh_insert_free_extent(start + num_pages, extent_start + extent_pages - (start + num_pages));
+
+	kh_next_fit_index = (start + num_pages) % KHEAP_NUM_PAGES;
+	return start;
+}
+
+//Reserve and map an allocation of "size" bytes, with pre-zeroed frames if "zeroed"
+static void* kh_allocate(unsigned int size, uint8 zeroed)
+{
+	uint32 required_num_pages = size/PAGE_SIZE + (size % PAGE_SIZE != 0);
+	if(required_num_pages == 0) return (void*)NULL;
+
+	//Allocations covering 4MB are aligned on 4MB (if possible) so that they can use large pages
+	uint32 start = KH_NIL;
+	if(required_num_pages >= KH_PAGES_PER_TABLE && !zeroed)
+		start = kh_reserve(required_num_pages, KH_PAGES_PER_TABLE);
+	if(start == KH_NIL)
+		start = kh_reserve(required_num_pages, 1);
+	if(start == KH_NIL) return (void*)NULL; //No suitable address was found
+
+	uint32 allocation_va = KH_PAGE_VA(start);
+	if(kh_map_pages(allocation_va, required_num_pages, zeroed) != 0) {
+		kh_release_range(start, required_num_pages);
+		return (void*)NULL;
+	}
+	allocated_pages[start] = required_num_pages;
 
 	return (void*)allocation_va;
 }
 
+void* kmalloc(unsigned int size)
+{
+	//TODO: [PROJECT 2019 - MS1 - [1] Kernel Heap] kmalloc()
+	return kh_allocate(size, 0);
+}
+
+//Like kmalloc() but the allocation is zeroed (its frames come from the pre-zeroed pool if possible)
+void* kzalloc(unsigned int size)
+{
+	return kh_allocate(size, 1);
+}
+
+//Like kmalloc() but only reserves the VA range: each page gets a zeroed frame
+//on its first touch (see kheap_lazy_fault()), so physical memory tracks actual use
+void* kmalloc_lazy(unsigned int size)
+{
+	uint32 required_num_pages = size/PAGE_SIZE + (size % PAGE_SIZE != 0);
+	if(required_num_pages == 0) return (void*)NULL;
+
+	uint32 start = kh_reserve(required_num_pages, 1);
+	if(start == KH_NIL) return (void*)NULL; //No suitable address was found
+
+	kh_set_lazy(start, required_num_pages, 1);
+	allocated_pages[start] = required_num_pages;
+
+	return (void*)KH_PAGE_VA(start);
+}
+
+//Called by fault_handler() on a kernel fault inside the kernel heap:
+//maps a zeroed frame if the faulted page belongs to a kmalloc_lazy() allocation
+//Return 1 if the fault is resolved, 0 otherwise
+int kheap_lazy_fault(uint32 fault_va)
+{
+	if(!KH_IS_HEAP_VA(fault_va))
+		return 0;
+	uint32 page_va = ROUNDDOWN(fault_va, PAGE_SIZE);
+	if(!KH_IS_LAZY(KH_PAGE_INDEX(page_va)))
+		return 0;
+
+	if(kh_map_pages(page_va, 1, 1) != 0)
+		return 0;
+	return 1;
+}
 
 void kfree(void* virtual_address)
 {
 	//TODO: [PROJECT 2019 - MS1 - [1] Kernel Heap] kfree()
 	//you need to get the size of the given allocation using its address
-	//found in allocated_mem[]
-	uint32 num_pages_to_free = 0;
-	int id;
-	for(int i = 0; i < allocation_counter; i++){
-		if(allocated_mem[i].virtual_address == (uint32)virtual_address){
-			num_pages_to_free = allocated_mem[i].allocated_pages;
-			id = i;
-			break;
-		}
-	}
-	//Shift to delete the chosen VA
-	for(int j = id + 1; j < allocation_counter; j++)
-		allocated_mem[j - 1] = allocated_mem[j];
-	allocation_counter--;
-	uint32 *ptr_table;
-	for(int i = 0, va = (uint32)virtual_address; i < num_pages_to_free; i++, va += PAGE_SIZE){
-		struct Frame_Info *ptr_frame_info = get_frame_info(ptr_page_directory, (void *)va, &ptr_table);
-		uint32 PA = to_physical_address(ptr_frame_info);
-		uint32 frame_number = PA/PAGE_SIZE;
-		va_retrieval[frame_number] = 0;
-		unmap_frame(ptr_page_directory, (void*)va);
-	}
+	//found in allocated_pages[]
+	uint32 num_pages_to_free = kh_allocation_size(virtual_address);
+	if(num_pages_to_free == 0) return; //Not an allocation start
+	allocated_pages[KH_PAGE_INDEX(virtual_address)] = 0;
+
+	kh_unmap_pages((uint32)virtual_address, num_pages_to_free);
+	kh_set_lazy(KH_PAGE_INDEX(virtual_address), num_pages_to_free, 0);
+	kh_release_range(KH_PAGE_INDEX(virtual_address), num_pages_to_free);
 }
 
 unsigned int kheap_virtual_address(unsigned int physical_address)
@@ -115,25 +597,13 @@ unsigned int kheap_virtual_address(unsigned int physical_address)
 	//TODO: [PROJECT 2019 - MS1 - [1] Kernel Heap] kheap_virtual_address()
 	//return the virtual address corresponding to given physical_address
 
-	struct Frame_Info* ptr_frame_info = to_frame_info(physical_address), *ptr_frame_info_tst;
+	struct Frame_Info* ptr_frame_info = to_frame_info(physical_address);
 	if(ptr_frame_info == NULL)
 		return 0;
 
-	uint32 frame_number = (physical_address/PAGE_SIZE);
-	if(va_retrieval[frame_number] != 0)
-		return va_retrieval[frame_number];
-	return 0;
-
-	//old method
-	/*
-	uint32* ptr_page_table;
-	for(int va = KERNEL_HEAP_START; va < KERNEL_HEAP_MAX; va += PAGE_SIZE){
-		ptr_frame_info_tst = get_frame_info(ptr_page_directory, (void*) va, &ptr_page_table);
-		if(ptr_frame_info_tst != NULL && ptr_frame_info_tst == ptr_frame_info)
-			return va;
-	}
+	if(KH_IS_HEAP_VA(ptr_frame_info->va))
+		return ptr_frame_info->va;
 	return 0;
-	*/
 }
 
 unsigned int kheap_physical_address(unsigned int virtual_address)
@@ -143,6 +613,9 @@ unsigned int kheap_physical_address(unsigned int virtual_address)
     if (virtual_address < KERNEL_HEAP_START || virtual_address > KERNEL_HEAP_MAX)
     	return 0;
 
+	if(KH_IS_LARGE(virtual_address))
+		return EXTRACT_ADDRESS(ptr_page_directory[PDX(virtual_address)]) + PTX(virtual_address)*PAGE_SIZE;
+
 	struct Frame_Info* ptr_frame_info;
 	uint32 *pageT;
 	ptr_frame_info = get_frame_info(ptr_page_directory, (void *)virtual_address, &pageT);
@@ -154,6 +627,153 @@ unsigned int kheap_physical_address(unsigned int virtual_address)
 }
 
 
+//=================================================================================//
+//============================== SLAB ALLOCATOR ===================================//
+//=================================================================================//
+//Object caches for small kernel objects, layered on kmalloc():
+//each slab is one kernel heap page that starts with a "struct kmem_slab" header followed by the objects.
+//The free objects of a slab are kept as a stack of their indices in the header (not in the objects
+//themselves), so alloc/free is an index pop/push and never writes into an object.
+//Objects are constructed (ctor) once when their slab is created, and must be freed back in their
+//constructed state so that they can be reused as is.
+
+#define KMEM_MAX_CACHES 32
+#define KMEM_MAX_EMPTY_SLABS 2	//empty slabs kept per cache before giving pages back to kmalloc
+#define KMEM_OBJECT_ALIGN 8
+
+struct kmem_slab
+{
+	LIST_ENTRY(kmem_slab) prev_next_info;
+	struct kmem_cache *cache;
+	uint32 num_in_use;
+	uint16 free_objects[];	//indices of the free objects, objects_per_slab - num_in_use of them
+};
+LIST_HEAD(kmem_slab_list, kmem_slab);
+
+struct kmem_cache
+{
+	char *name;
+	uint32 object_size;
+	uint32 objects_per_slab;
+	uint32 first_object_offset;	//from the start of the slab, after the header and its free stack
+	void (*ctor)(void *);
+	struct kmem_slab_list partial_slabs;
+	struct kmem_slab_list full_slabs;
+	struct kmem_slab_list empty_slabs;
+	uint8 used;
+}kmem_caches[KMEM_MAX_CACHES];
+
+#define KMEM_OBJECTS_OFFSET(num_objects) ROUNDUP(sizeof(struct kmem_slab) + (num_objects)*sizeof(uint16), KMEM_OBJECT_ALIGN)
+#define KMEM_OBJECT(slab, index) ((uint8*)(slab) + (slab)->cache->first_object_offset + (index)*(slab)->cache->object_size)
+
+//Create a cache of objects of "object_size" bytes (< PAGE_SIZE), "ctor" may be NULL
+//Return NULL if no more caches can be created
+struct kmem_cache* kmem_cache_create(char *name, uint32 object_size, void (*ctor)(void *))
+{
+	object_size = ROUNDUP(object_size == 0 ? 1 : object_size, KMEM_OBJECT_ALIGN);
+	uint32 objects_per_slab = (PAGE_SIZE - sizeof(struct kmem_slab)) / (object_size + sizeof(uint16));
+	while(objects_per_slab > 0 && KMEM_OBJECTS_OFFSET(objects_per_slab) + objects_per_slab*object_size > PAGE_SIZE)
+		objects_per_slab--;
+	if(objects_per_slab == 0)
+		return NULL;
+
+	for(int i = 0; i < KMEM_MAX_CACHES; i++) {
+		if(kmem_caches[i].used)
+			continue;
+		struct kmem_cache *cache = &kmem_caches[i];
+		cache->name = name;
+		cache->object_size = object_size;
+		cache->objects_per_slab = objects_per_slab;
+		cache->first_object_offset = KMEM_OBJECTS_OFFSET(objects_per_slab);
+		cache->ctor = ctor;
+		LIST_INIT(&cache->partial_slabs);
+		LIST_INIT(&cache->full_slabs);
+		LIST_INIT(&cache->empty_slabs);
+		cache->used = 1;
+		return cache;
+	}
+	return NULL;
+}
+
+static struct kmem_slab* kmem_slab_create(struct kmem_cache *cache)
+{
+	struct kmem_slab *slab = kmalloc(PAGE_SIZE);
+	if(slab == NULL)
+		return NULL;
+	slab->cache = cache;
+	slab->num_in_use = 0;
+
+	//(pushed from the last one, so that the objects are handed out in address order)
+	for(uint32 i = 0; i < cache->objects_per_slab; i++) {
+		uint32 index = cache->objects_per_slab - 1 - i;
+		if(cache->ctor != NULL)
+			cache->ctor(KMEM_OBJECT(slab, index));
+		slab->free_objects[i] = index;
+	}
+	return slab;
+}
+
+void* kmem_cache_alloc(struct kmem_cache *cache)
+{
+	struct kmem_slab *slab = LIST_FIRST(&cache->partial_slabs);
+	if(slab != NULL)
+		LIST_REMOVE(&cache->partial_slabs, slab);
+	else if((slab = LIST_FIRST(&cache->empty_slabs)) != NULL)
+		LIST_REMOVE(&cache->empty_slabs, slab);
+	else if((slab = kmem_slab_create(cache)) == NULL)
+		return NULL;
+
+	slab->num_in_use++;
+	void *object = KMEM_OBJECT(slab, slab->free_objects[cache->objects_per_slab - slab->num_in_use]);
+
+	if(slab->num_in_use == cache->objects_per_slab)
+		LIST_INSERT_HEAD(&cache->full_slabs, slab);
+	else
+		LIST_INSERT_HEAD(&cache->partial_slabs, slab);
+	return object;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *object)
+{
+	struct kmem_slab *slab = ROUNDDOWN(object, PAGE_SIZE);
+	assert(slab->cache == cache);
+
+	if(slab->num_in_use == cache->objects_per_slab)
+		LIST_REMOVE(&cache->full_slabs, slab);
+	else
+		LIST_REMOVE(&cache->partial_slabs, slab);
+
+	slab->free_objects[cache->objects_per_slab - slab->num_in_use] = ((uint8*)object - KMEM_OBJECT(slab, 0)) / cache->object_size;
+	slab->num_in_use--;
+
+	if(slab->num_in_use != 0)
+		LIST_INSERT_HEAD(&cache->partial_slabs, slab);
+	else if(LIST_SIZE(&cache->empty_slabs) < KMEM_MAX_EMPTY_SLABS)
+		LIST_INSERT_HEAD(&cache->empty_slabs, slab);
+	else
+		kfree(slab);
+}
+
+//Give all empty slabs of the cache back to kmalloc
+void kmem_cache_shrink(struct kmem_cache *cache)
+{
+	struct kmem_slab *slab;
+	while((slab = LIST_FIRST(&cache->empty_slabs)) != NULL) {
+		LIST_REMOVE(&cache->empty_slabs, slab);
+		kfree(slab);
+	}
+}
+
+//Destroy the cache, all of its objects must be already freed
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	if(LIST_FIRST(&cache->partial_slabs) != NULL || LIST_FIRST(&cache->full_slabs) != NULL)
+		panic("kmem_cache_destroy: cache \"%s\" still has allocated objects", cache->name);
+	kmem_cache_shrink(cache);
+	cache->used = 0;
+}
+
+
 //=================================================================================//
 //============================== BONUS FUNCTION ===================================//
 //=================================================================================//
@@ -170,9 +790,74 @@ unsigned int kheap_physical_address(unsigned int virtual_address)
 void *krealloc(void *virtual_address, uint32 new_size)
 {
 	//TODO: [PROJECT 2019 - BONUS2] Kernel Heap Realloc
-	// Write your code here, remove the panic and write your code
+	if(virtual_address == NULL)
+		return kmalloc(new_size);
+	if(new_size == 0) {
+		kfree(virtual_address);
+		return NULL;
+	}
 
-	return NULL;
-	panic("krealloc() is not implemented yet...!!");
+	uint32 old_num_pages = kh_allocation_size(virtual_address);
+	if(old_num_pages == 0)
+		return NULL;
+	uint32 new_num_pages = new_size/PAGE_SIZE + (new_size % PAGE_SIZE != 0);
+	uint32 start = KH_PAGE_INDEX(virtual_address);
+	uint32 va = (uint32)virtual_address;
+
+	//[1] Shrink in place: unmap the tail frames
+	if(new_num_pages <= old_num_pages) {
+		if(new_num_pages < old_num_pages) {
+			kh_unmap_pages(va + new_num_pages*PAGE_SIZE, old_num_pages - new_num_pages);
+			kh_set_lazy(start + new_num_pages, old_num_pages - new_num_pages, 0);
+			kh_release_range(start + new_num_pages, old_num_pages - new_num_pages);
+			allocated_pages[start] = new_num_pages;
+		}
+		return virtual_address;
+	}
+
+	//[2] Grow in place: the pages right after the allocation are free
+	//	  (lazy allocations stay lazy: the extra pages are only reserved)
+	uint32 extra_pages = new_num_pages - old_num_pages;
+	uint8 lazy = KH_IS_LAZY(start) ? 1 : 0;
+	if(kh_free_pages_after(start, old_num_pages) >= extra_pages) {
+		kh_take_pages(start + old_num_pages, extra_pages);
+		if(lazy)
+			kh_set_lazy(start + old_num_pages, extra_pages, 1);
+		else if(kh_map_pages(va + old_num_pages*PAGE_SIZE, extra_pages, 0) != 0) {
+			kh_release_range(start + old_num_pages, extra_pages);
+			return NULL;
+		}
+		allocated_pages[start] = new_num_pages;
+		return virtual_address;
+	}
+
+	//[3] Move: map the extra frames at the new range first (so that failure leaves the old one intact),
+	//	  then move the old frames by remapping their page table entries instead of copying their contents
+	uint32 new_start = kh_find_free_extent(new_num_pages);
+	if(new_start == KH_NIL)
+		return NULL;
+	kh_take_pages(new_start, new_num_pages);
+	uint32 new_va = KH_PAGE_VA(new_start);
+	if(lazy)
+		kh_set_lazy(new_start, new_num_pages, 1);
+	else if(kh_map_pages(new_va + old_num_pages*PAGE_SIZE, extra_pages, 0) != 0) {
+		kh_release_range(new_start, new_num_pages);
+		return NULL;
+	}
+
+	kh_demote_range(va, old_num_pages);
+	if(kh_move_pages(va, new_va, old_num_pages) != 0) {
+		if(lazy)
+			kh_set_lazy(new_start, new_num_pages, 0);
+		else
+			kh_unmap_pages(new_va + old_num_pages*PAGE_SIZE, extra_pages);
+		kh_release_range(new_start, new_num_pages);
+		return NULL;
+	}
+	allocated_pages[start] = 0;
+	kh_set_lazy(start, old_num_pages, 0);
+	kh_release_range(start, old_num_pages);
+	allocated_pages[new_start] = new_num_pages;
 
+	return (void*)new_va;
 }
@@ -42,6 +42,17 @@ inline uint32 pd_is_table_used(struct Env *e, uint32 virtual_address);
 inline void pd_set_table_unused(struct Env *e, uint32 virtual_address);
 inline void pd_clear_page_dir_entry(struct Env *e, uint32 virtual_address);
 
+void page_daemon_clean_frame(struct Frame_Info *ptr_frame_info);
+void user_large_page_demote(uint32 *ptr_page_directory, uint32 virtual_address);
+void user_large_page_reclaim();
+void user_large_page_free(struct Env *e, uint32 virtual_address);
+void user_large_page_free_exited();
+void user_large_page_prepare_block();
+void env_page_ws_free_index_exited();
+static inline void user_large_page_split(uint32 *ptr_page_directory, uint32 virtual_address);
+static inline void set_page_table_entry(uint32 *ptr_page_directory, uint32 *ptr_page_table, uint32 virtual_address, uint32 entry);
+int env_page_ws_get_free_entry(struct Env *e);
+
 
 // These variables are set in initialize_kernel_VM()
 uint32* ptr_page_directory;		// Virtual address of boot time page directory
@@ -54,6 +65,13 @@ struct Frame_Info* frames_info;		// Virtual address of physical frames_info arra
 struct Frame_Info* disk_frames_info;		// Virtual address of physical frames_info array
 struct Linked_List free_frame_list;	// Free list of physical frames_info
 struct Linked_List modified_frame_list;
+struct Linked_List zeroed_frame_list;	// Pre-zeroed free frames (see allocate_zeroed_frame())
+uint8* buddy_order;		// Order of the free block starting at each frame (buddy frame allocator)
+// Num of frames in the free blocks (freeNotBuffered), in free_frame_list (freeBuffered) and
+// in modified_frame_list (modified), kept up to date by the buddy allocator and the buffer lists
+struct freeFramesCounters frames_counters;
+uint16* page_table_live_entries;	// Num of non-empty entries of each page table, indexed by the frame number of the table
+uint32* compaction_movable;		// One bit per frame, set for the movable frames (see compact_frames())
 
 
 ///**************************** MAPPING KERNEL SPACE *******************************
@@ -141,6 +159,16 @@ void initialize_kernel_VM()
   disk_frames_info = boot_allocate_space(disk_array_size , PAGE_SIZE);
   memset(disk_frames_info , 0, disk_array_size);
 
+  //order of the free block starting at each frame (see the buddy frame allocator)
+  buddy_order = boot_allocate_space(number_of_frames, PAGE_SIZE);
+
+  //num of non-empty entries of the page table held by each frame (see set_page_table_entry())
+  page_table_live_entries = boot_allocate_space(number_of_frames * sizeof(uint16), PAGE_SIZE);
+  memset(page_table_live_entries, 0, number_of_frames * sizeof(uint16));
+
+  //movable frames found by the last compaction (see compact_frames())
+  compaction_movable = boot_allocate_space(ROUNDUP(number_of_frames, 32) / 8, PAGE_SIZE);
+
   // This allows the kernel & user to access any page table entry using a
   // specified VA for each: VPT for kernel and UVPT for User.
   setup_listing_to_all_page_tables_entries();
@@ -325,6 +353,7 @@ uint32* boot_get_page_table(uint32 *ptr_page_directory, uint32 virtual_address,
 //
 
 extern void initialize_disk_page_file();
+static void initialize_buddy_allocator();
 void initialize_paging()
 {
   // The example code here marks all frames_info as free.
@@ -343,6 +372,8 @@ void initialize_paging()
   int i;
   LIST_INIT(&free_frame_list);
   LIST_INIT(&modified_frame_list);
+  LIST_INIT(&zeroed_frame_list);
+  initialize_buddy_allocator();
 
   frames_info[0].references = 1;
   frames_info[1].references = 1;
@@ -350,7 +381,8 @@ void initialize_paging()
   ptr_zero_page = (uint8*) KERNEL_BASE+PAGE_SIZE;
   ptr_temp_page = (uint8*) KERNEL_BASE+2*PAGE_SIZE;
   i =0;
-  for(;i<1024; i++)
+  //(the whole zero page: its frame is also mapped read-only for never written user pages)
+  for(;i<PAGE_SIZE; i++)
   {
     ptr_zero_page[i]=0;
     ptr_temp_page[i]=0;
@@ -361,10 +393,8 @@ void initialize_paging()
   for (i = 3; i < range_end/PAGE_SIZE; i++)
   {
 
-    initialize_frame_info(&(frames_info[i]));
     //frames_info[i].references = 0;
-
-    LIST_INSERT_HEAD(&free_frame_list, &frames_info[i]);
+    free_frame(&frames_info[i]);
   }
 
   for (i = PHYS_IO_MEM/PAGE_SIZE ; i < PHYS_EXTENDED_MEM/PAGE_SIZE; i++)
@@ -381,10 +411,8 @@ void initialize_paging()
 
   for (i = range_end/PAGE_SIZE ; i < number_of_frames; i++)
   {
-    initialize_frame_info(&(frames_info[i]));
-
     //frames_info[i].references = 0;
-    LIST_INSERT_HEAD(&free_frame_list, &frames_info[i]);
+    free_frame(&frames_info[i]);
   }
 
   initialize_disk_page_file();
@@ -400,6 +428,97 @@ void initialize_frame_info(struct Frame_Info *ptr_frame_info)
   memset(ptr_frame_info, 0, sizeof(*ptr_frame_info));
 }
 
+//==================== BUDDY FRAME ALLOCATOR ====================
+// The free frames are kept in blocks of 2^order contiguous frames, a block of order k
+// starting at a frame number multiple of 2^k. The first frame of each free block is
+// linked in buddy_free_lists[k] and buddy_order[] holds k for it (BUDDY_NOT_FREE for all
+// other frames). The free_frame_list only holds the clean BUFFERED frames, which are
+// reclaimed by allocate_frame() when no free block is left.
+
+#define BUDDY_MAX_ORDER 10	// 4MB blocks
+#define BUDDY_NOT_FREE 0xFF
+
+struct Linked_List buddy_free_lists[BUDDY_MAX_ORDER + 1];
+
+static inline void buddy_insert_block(uint32 frame_number, uint32 order)
+{
+  buddy_order[frame_number] = order;
+  frames_counters.freeNotBuffered += (1 << order);
+  LIST_INSERT_HEAD(&buddy_free_lists[order], &frames_info[frame_number]);
+}
+
+static inline void buddy_remove_block(uint32 frame_number, uint32 order)
+{
+  buddy_order[frame_number] = BUDDY_NOT_FREE;
+  frames_counters.freeNotBuffered -= (1 << order);
+  LIST_REMOVE(&buddy_free_lists[order], &frames_info[frame_number]);
+}
+
+static void initialize_buddy_allocator()
+{
+  for (int order = 0; order <= BUDDY_MAX_ORDER; order++)
+    LIST_INIT(&buddy_free_lists[order]);
+  memset(buddy_order, BUDDY_NOT_FREE, number_of_frames);
+}
+
+//
+// Allocates 2^order physically contiguous frames, the first one aligned
+// on a multiple of 2^order frames.
+// Does NOT set the contents of the frames to zero.
+//
+// *ptr_frame_info -- is set to point to the Frame_Info struct of the
+// first frame, the others follow it in frames_info
+//
+// RETURNS
+//   0 -- on success
+//   E_NO_MEM -- if there's no free block of this order (it does NOT panic, and does NOT
+//               compact the frames: see compact_frames())
+//
+int allocate_frames(uint32 order, struct Frame_Info **ptr_frame_info)
+{
+  uint32 k = order;
+  while (k <= BUDDY_MAX_ORDER && LIST_FIRST(&buddy_free_lists[k]) == NULL)
+    k++;
+  if (k > BUDDY_MAX_ORDER)
+    return E_NO_MEM;
+
+  uint32 frame_number = LIST_FIRST(&buddy_free_lists[k]) - frames_info;
+  buddy_remove_block(frame_number, k);
+  //split: give back the upper half until the block has the required order
+  while (k > order)
+  {
+    k--;
+    buddy_insert_block(frame_number + (1 << k), k);
+  }
+
+  for (uint32 i = 0; i < (1 << order); i++)
+    initialize_frame_info(&frames_info[frame_number + i]);
+  *ptr_frame_info = &frames_info[frame_number];
+  return 0;
+}
+
+//
+// Return the 2^order frames starting at 'ptr_frame_info' (allocated by allocate_frames())
+// to the free blocks, merging them with their free buddies.
+//
+void free_frames(struct Frame_Info *ptr_frame_info, uint32 order)
+{
+  uint32 frame_number = ptr_frame_info - frames_info;
+  for (uint32 i = 0; i < (1 << order); i++)
+    initialize_frame_info(&frames_info[frame_number + i]);
+
+  while (order < BUDDY_MAX_ORDER)
+  {
+    uint32 buddy = frame_number ^ (1 << order);
+    if (buddy + (1 << order) > number_of_frames || buddy_order[buddy] != order)
+      break;
+    buddy_remove_block(buddy, order);
+    frame_number &= ~(1 << order);
+    order++;
+  }
+  buddy_insert_block(frame_number, order);
+}
+
 //
 // Allocates a physical frame.
 // Does NOT set the contents of the physical frame to zero -
@@ -412,21 +531,33 @@ void initialize_frame_info(struct Frame_Info *ptr_frame_info)
 //   0 -- on success
 //   If failed, it panic.
 //
-// Hint: use LIST_FIRST, LIST_REMOVE, and initialize_frame_info
 // Hint: references should not be incremented
 
 extern void env_free(struct Env *e);
 
 int allocate_frame(struct Frame_Info **ptr_frame_info)
 {
+  //a free frame first, then a pre-zeroed one, else the oldest clean buffered frame
+  if (allocate_frames(0, ptr_frame_info) == 0)
+    return 0;
+  *ptr_frame_info = LIST_FIRST(&zeroed_frame_list);
+  if (*ptr_frame_info != NULL)
+  {
+    LIST_REMOVE(&zeroed_frame_list, *ptr_frame_info);
+    initialize_frame_info(*ptr_frame_info);
+    return 0;
+  }
+
+  //(last resort: write back a modified frame now instead of waiting for the page daemon)
+  if (LIST_FIRST(&free_frame_list) == NULL && LIST_FIRST(&modified_frame_list) != NULL)
+    page_daemon_clean_frame(LIST_FIRST(&modified_frame_list));
   *ptr_frame_info = LIST_FIRST(&free_frame_list);
-  int c = 0;
   if (*ptr_frame_info == NULL)
   {
     panic("ERROR: Kernel run out of memory... allocate_frame cannot find a free frame.\n");
   }
 
-  LIST_REMOVE(&free_frame_list,*ptr_frame_info);
+  bufferlist_remove_page(&free_frame_list,*ptr_frame_info);
 
   /******************* PAGE BUFFERING CODE *******************
    ***********************************************************/
@@ -446,20 +577,15 @@ int allocate_frame(struct Frame_Info **ptr_frame_info)
 }
 
 //
-// Return a frame to the free_frame_list.
+// Return a frame to the free blocks.
 // (This function should only be called when ptr_frame_info->references reaches 0.)
 //
 void free_frame(struct Frame_Info *ptr_frame_info)
 {
   /*2012: clear it to ensure that its members (env, isBuffered, ...) become NULL*/
-  initialize_frame_info(ptr_frame_info);
-  /*=============================================================================*/
-
-  // Fill this function in
-  LIST_INSERT_HEAD(&free_frame_list, ptr_frame_info);
+  /*(done by free_frames())*/
+  free_frames(ptr_frame_info, 0);
   //LOG_STATMENT(cprintf("FN # %d FREED",to_frame_number(ptr_frame_info)));
-
-
 }
 
 //
@@ -472,6 +598,477 @@ void decrement_references(struct Frame_Info* ptr_frame_info)
     free_frame(ptr_frame_info);
 }
 
+//==================== PRE-ZEROED FRAMES POOL ====================
+// Frames zeroed ahead of time (by refill_zeroed_frames_pool(), a batch per clock tick once
+// the pool went below its low watermark, until it's full) so that allocate_zeroed_frame()
+// doesn't zero on the fault path.
+// They are still free frames: allocate_frame() takes them before reclaiming a buffered frame.
+
+#define ZEROED_FRAMES_POOL_SIZE 64
+#define ZEROED_FRAMES_POOL_LOW (ZEROED_FRAMES_POOL_SIZE / 4)	// the refill starts below it
+#define ZEROED_FRAMES_REFILL_BATCH 8	// frames zeroed per clock tick
+uint8 zeroed_frames_refilling;	// went below the low watermark, not full yet
+
+extern uint8 page_daemon_reclaiming;
+
+#define NUM_SCRATCH_PAGES 2
+uint32 scratch_pages_va;	// kernel pages used to access frames that are not statically mapped
+
+extern void* kmalloc_lazy(unsigned int size);
+
+//
+// Return a kernel virtual address of the given frame: with the kernel heap, only the boot
+// memory is statically mapped, so the frame is mapped at scratch page "slot" (reserved once,
+// they never get frames of their own) until unmap_scratch_frame(slot)
+//
+static void* map_scratch_frame(struct Frame_Info *ptr_frame_info, uint32 slot)
+{
+  uint32 physical_address = to_physical_address(ptr_frame_info);
+  if (!USE_KHEAP)
+    return STATIC_KERNEL_VIRTUAL_ADDRESS(physical_address);
+
+  if (scratch_pages_va == 0)
+    scratch_pages_va = (uint32)kmalloc_lazy(NUM_SCRATCH_PAGES*PAGE_SIZE);
+  uint32 va = scratch_pages_va + slot*PAGE_SIZE;
+  uint32 *ptr_page_table;
+  get_page_table(ptr_page_directory, (void*)va, &ptr_page_table);
+  set_page_table_entry(ptr_page_directory, ptr_page_table, va, CONSTRUCT_ENTRY(physical_address, PERM_WRITEABLE|PERM_PRESENT));
+  tlb_invalidate(ptr_page_directory, (void*)va);
+  return (void*)va;
+}
+
+static void unmap_scratch_frame(uint32 slot)
+{
+  if (!USE_KHEAP)
+    return;
+  uint32 va = scratch_pages_va + slot*PAGE_SIZE;
+  uint32 *ptr_page_table;
+  get_page_table(ptr_page_directory, (void*)va, &ptr_page_table);
+  set_page_table_entry(ptr_page_directory, ptr_page_table, va, 0);
+  tlb_invalidate(ptr_page_directory, (void*)va);
+}
+
+//
+// Set the contents of the given frame to zero
+//
+void zero_frame(struct Frame_Info *ptr_frame_info)
+{
+  memset(map_scratch_frame(ptr_frame_info, 0), 0, PAGE_SIZE);
+  unmap_scratch_frame(0);
+}
+
+//
+// Allocates a physical frame whose contents are set to zero,
+// taken from the pre-zeroed pool if not empty.
+//
+// RETURNS
+//   0 -- on success
+//   If failed, it panic (as allocate_frame()).
+//
+int allocate_zeroed_frame(struct Frame_Info **ptr_frame_info)
+{
+  *ptr_frame_info = LIST_FIRST(&zeroed_frame_list);
+  if (*ptr_frame_info != NULL)
+  {
+    LIST_REMOVE(&zeroed_frame_list, *ptr_frame_info);
+    initialize_frame_info(*ptr_frame_info);
+    return 0;
+  }
+
+  int ret = allocate_frame(ptr_frame_info);
+  if (ret != 0)
+    return ret;
+  zero_frame(*ptr_frame_info);
+  return 0;
+}
+
+//
+// Zero up to ZEROED_FRAMES_REFILL_BATCH free frames into the pool, from when it goes below
+// ZEROED_FRAMES_POOL_LOW until it's full (only takes free frames, never buffered ones, and
+// nothing while the page daemon is reclaiming). Called on each clock tick.
+//
+void refill_zeroed_frames_pool()
+{
+  struct Frame_Info *ptr_frame_info;
+  if (LIST_SIZE(&zeroed_frame_list) < ZEROED_FRAMES_POOL_LOW)
+    zeroed_frames_refilling = 1;
+  if (!zeroed_frames_refilling || page_daemon_reclaiming)
+    return;
+  for (int i = 0; i < ZEROED_FRAMES_REFILL_BATCH && LIST_SIZE(&zeroed_frame_list) < ZEROED_FRAMES_POOL_SIZE
+      && allocate_frames(0, &ptr_frame_info) == 0; i++)
+  {
+    zero_frame(ptr_frame_info);
+    LIST_INSERT_HEAD(&zeroed_frame_list, ptr_frame_info);
+  }
+  if (LIST_SIZE(&zeroed_frame_list) >= ZEROED_FRAMES_POOL_SIZE)
+    zeroed_frames_refilling = 0;
+}
+
+//==================== COPY-ON-WRITE ====================
+// A frame shared copy-on-write is mapped read-only with PERM_COW in each env using it
+// (its references count the mappings). The first write fault on it gives the writer a
+// private copy, or just makes the page writable again if it's the last mapping.
+
+//
+// Copy the page mapped at 'src_virtual_address' (in the current page directory)
+// to frame 'ptr_dst_frame'
+//
+static void copy_frame(struct Frame_Info *ptr_dst_frame, uint32 src_virtual_address)
+{
+  memcpy(map_scratch_frame(ptr_dst_frame, 0), (void*)src_virtual_address, PAGE_SIZE);
+  unmap_scratch_frame(0);
+}
+
+//
+// Handle a write fault at 'virtual_address' on a present PERM_COW page of 'ptr_env' (the current env)
+//
+// RETURNS
+//   0 -- on success
+//   E_NO_MEM -- if no frame is left for the copy (the page is left shared)
+//
+int cow_fault(struct Env *ptr_env, uint32 virtual_address)
+{
+  virtual_address = ROUNDDOWN(virtual_address, PAGE_SIZE);
+  uint32 *ptr_page_table;
+  struct Frame_Info *ptr_frame_info = get_frame_info(ptr_env->env_page_directory, (void*)virtual_address, &ptr_page_table);
+  assert(ptr_frame_info != NULL
+      && (ptr_page_table[PTX(virtual_address)] & (PERM_PRESENT|PERM_COW)) == (PERM_PRESENT|PERM_COW));
+
+  //shared zero frame: no need to copy it
+  if (ptr_frame_info == to_frame_info(STATIC_KERNEL_PHYSICAL_ADDRESS(ptr_zero_page)))
+  {
+    struct Frame_Info *ptr_zeroed_frame;
+    if (allocate_zeroed_frame(&ptr_zeroed_frame) != 0)
+      return E_NO_MEM;
+    map_frame(ptr_env->env_page_directory, ptr_zeroed_frame, (void*)virtual_address, PERM_USER|PERM_WRITEABLE|PERM_PRESENT);
+    tlb_invalidate(ptr_env->env_page_directory, (void*)virtual_address);
+    return 0;
+  }
+
+  //last mapping of the frame: take it over
+  if (ptr_frame_info->references == 1)
+  {
+    pt_set_page_permissions(ptr_env, virtual_address, PERM_WRITEABLE, PERM_COW);
+    return 0;
+  }
+
+  struct Frame_Info *ptr_copy_frame;
+  if (allocate_frame(&ptr_copy_frame) != 0)
+    return E_NO_MEM;
+  copy_frame(ptr_copy_frame, virtual_address);
+  //(map_frame() drops the mapping of the shared frame)
+  map_frame(ptr_env->env_page_directory, ptr_copy_frame, (void*)virtual_address, PERM_USER|PERM_WRITEABLE|PERM_PRESENT);
+  tlb_invalidate(ptr_env->env_page_directory, (void*)virtual_address);
+  return 0;
+}
+
+//
+// Drop the mapping of the never written page 'virtual_address' of 'ptr_env' on the shared zero
+// frame: its entry is marked PERM_ZERO_FILL again, so nothing is written to the page file and
+// its next fault maps the zero frame again
+//
+void zero_fill_page_unmap(struct Env *ptr_env, uint32 virtual_address)
+{
+  uint32 *ptr_page_table;
+  struct Frame_Info *ptr_frame_info = get_frame_info(ptr_env->env_page_directory, (void*)virtual_address, &ptr_page_table);
+  assert(ptr_frame_info == to_frame_info(STATIC_KERNEL_PHYSICAL_ADDRESS(ptr_zero_page)));
+  decrement_references(ptr_frame_info);
+  set_page_table_entry(ptr_env->env_page_directory, ptr_page_table, virtual_address, PERM_ZERO_FILL);
+  tlb_invalidate(ptr_env->env_page_directory, (void*)virtual_address);
+}
+
+//
+// Write the contents of frame 'ptr_frame_info' to page 'virtual_address' of the page file of 'ptr_env'
+//
+static void env_write_page_to_page_file(struct Env *ptr_env, uint32 virtual_address, struct Frame_Info *ptr_frame_info)
+{
+  if (pf_update_env_page(ptr_env, (void*)virtual_address, ptr_frame_info) == E_PAGE_NOT_EXIST_IN_PF)
+  {
+    pf_add_empty_env_page(ptr_env, virtual_address, 0);
+    pf_update_env_page(ptr_env, (void*)virtual_address, ptr_frame_info);
+  }
+}
+
+//
+// Duplicate the pages of 'ptr_src_env' in [start_virtual_address, end_virtual_address) into
+// 'ptr_dst_env', copy-on-write where possible, so duplicating an env mostly costs page table entries.
+//
+// Details:
+//   - Resident pages are shared: both envs map the same frames, the writable ones read-only
+//     with PERM_COW, and each one is added to the working set of 'ptr_dst_env' while it has
+//     free entries.
+//   - The other pages with contents (resident ones beyond the working set of 'ptr_dst_env',
+//     buffered ones and the ones in the page file of 'ptr_src_env') are written to the page
+//     file of 'ptr_dst_env', so that its faults never read older contents of its own.
+//   - Never written pages stay never written (PERM_ZERO_FILL) in 'ptr_dst_env'.
+//   - The pages in the page file of 'ptr_src_env' are read through its own mappings (on one
+//     frame for the whole call), so it must be the current env (as for a fork). The pages that
+//     are not in its page file (never touched) cost no read.
+//   - 'ptr_dst_env' must have nothing in memory in the range yet (e.g. a new env).
+//
+// RETURNS:
+//   the number of shared pages
+//
+uint32 env_share_cow(struct Env *ptr_src_env, struct Env *ptr_dst_env, uint32 start_virtual_address, uint32 end_virtual_address)
+{
+  assert(ptr_src_env == curenv && ptr_dst_env != ptr_src_env);
+  uint32 num_shared_pages = 0;
+  struct Frame_Info *ptr_read_frame = NULL;	// (its own reference keeps it across the unmaps)
+  uint32 *ptr_page_table;
+  uint32 va = ROUNDDOWN(start_virtual_address, PAGE_SIZE);
+  while (va < end_virtual_address)
+  {
+    if (ptr_src_env->env_page_directory[PDX(va)] == 0)
+    {
+      va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+      continue;
+    }
+    //(a 4MB page is demoted, its pages then have their own entries)
+    user_large_page_split(ptr_src_env->env_page_directory, va);
+    get_page_table(ptr_src_env->env_page_directory, (void*)va, &ptr_page_table);
+    for (; va < end_virtual_address; va += PAGE_SIZE)
+    {
+      uint32 *ptr_entry = &ptr_page_table[PTX(va)];
+      assert((pt_get_page_permissions(ptr_dst_env, va) & (PERM_PRESENT|PERM_BUFFERED)) == 0);
+      if ((*ptr_entry & PERM_PRESENT) == PERM_PRESENT)
+      {
+        if (env_page_ws_get_free_entry(ptr_dst_env) != -1)
+        {
+          if ((*ptr_entry & PERM_WRITEABLE) == PERM_WRITEABLE)
+            *ptr_entry = (*ptr_entry & ~PERM_WRITEABLE) | PERM_COW;
+          map_frame(ptr_dst_env->env_page_directory, to_frame_info(EXTRACT_ADDRESS(*ptr_entry)), (void*)va, *ptr_entry & (PERM_USER|PERM_WRITEABLE|PERM_COW));
+          PFH_add_to_working_set(ptr_dst_env, va);
+          num_shared_pages++;
+        }
+        else
+          env_write_page_to_page_file(ptr_dst_env, va, to_frame_info(EXTRACT_ADDRESS(*ptr_entry)));
+      }
+      else if (*ptr_entry & PERM_BUFFERED)
+        env_write_page_to_page_file(ptr_dst_env, va, to_frame_info(EXTRACT_ADDRESS(*ptr_entry)));
+      else if (*ptr_entry & PERM_ZERO_FILL)
+      {
+        uint32 *ptr_dst_page_table;
+        if (get_page_table(ptr_dst_env->env_page_directory, (void*)va, &ptr_dst_page_table) == TABLE_NOT_EXIST && USE_KHEAP)
+          ptr_dst_page_table = create_page_table(ptr_dst_env->env_page_directory, va);
+        if (ptr_dst_page_table != NULL)
+          set_page_table_entry(ptr_dst_env->env_page_directory, ptr_dst_page_table, va, PERM_ZERO_FILL);
+        env_write_page_to_page_file(ptr_dst_env, va, to_frame_info(STATIC_KERNEL_PHYSICAL_ADDRESS(ptr_zero_page)));
+      }
+      else if (*ptr_entry == 0) //in the page file of 'ptr_src_env', or not used
+      {
+        if (ptr_read_frame == NULL)
+        {
+          if (allocate_frame(&ptr_read_frame) != 0)
+            panic("env_share_cow: no free frame to read the page file of the source env\n");
+          ptr_read_frame->references = 1;
+        }
+        map_frame(ptr_src_env->env_page_directory, ptr_read_frame, (void*)va, PERM_PRESENT|PERM_USER|PERM_WRITEABLE);
+        if (pf_read_env_page(ptr_src_env, (void*)va) != E_PAGE_NOT_EXIST_IN_PF)
+          env_write_page_to_page_file(ptr_dst_env, va, ptr_read_frame);
+        unmap_frame(ptr_src_env->env_page_directory, (void*)va);
+      }
+      if (PTX(va) == 1023)
+      {
+        va += PAGE_SIZE;
+        break;
+      }
+    }
+  }
+
+  if (ptr_read_frame != NULL)
+    decrement_references(ptr_read_frame);
+  //the source entries lost their write permission
+  tlbflush();
+  return num_shared_pages;
+}
+
+//==================== SAME-PAGE MERGING ====================
+// When enabled (enablePageMerging()), page_merging_scan() runs every PAGE_MERGING_SCAN_INTERVAL
+// clock ticks: it visits PAGE_MERGING_SCAN_BATCH resident pages of the working sets of the envs (round-robin) and
+// merges identical ones into one read-only frame shared copy-on-write (cow_fault() splits it
+// again on write). All-zero pages are merged into the shared zero frame.
+// Only pages not modified since they were loaded are merged, so the page file still holds
+// their contents. The candidate frames are indexed by a hash of their contents.
+
+#define PAGE_MERGING_SCAN_BATCH 16
+#define PAGE_MERGING_SCAN_INTERVAL 8	// clock ticks
+#define PAGE_MERGING_HASH_SIZE 1024
+
+struct merged_frame
+{
+  uint32 hash;
+  struct Frame_Info *ptr_frame_info;
+  struct Env *owner;	// env that mapped the frame when it was indexed...
+  uint32 owner_va;	// ...at this page
+  struct merged_frame *next;
+};
+
+struct kmem_cache;
+extern struct kmem_cache* kmem_cache_create(char *name, uint32 object_size, void (*ctor)(void *));
+extern void* kmem_cache_alloc(struct kmem_cache *cache);
+extern void kmem_cache_free(struct kmem_cache *cache, void *object);
+
+struct merged_frame *merged_frames_hash[PAGE_MERGING_HASH_SIZE];
+struct kmem_cache *merged_frames_cache;
+uint32 page_merging_zero_hash;
+uint32 page_merging_env_index, page_merging_ws_index;	// position of the scan
+uint32 page_merging_frames_saved;	// frames released by the merges so far
+
+uint32 page_merging_get_frames_saved()
+{
+  return page_merging_frames_saved;
+}
+
+//FNV-1a hash of the contents of a page
+static uint32 page_merging_hash(uint32 *words)
+{
+  uint32 hash = 2166136261u;
+  for (int i = 0; i < PAGE_SIZE/4; i++)
+    hash = (hash ^ words[i]) * 16777619u;
+  return hash;
+}
+
+//Entry of 'virtual_address' in the page table of 'ptr_env', 0 if its table is not in main memory
+static uint32 page_merging_get_entry(struct Env *ptr_env, uint32 virtual_address)
+{
+  //(4MB pages are not merged)
+  if ((ptr_env->env_page_directory[PDX(virtual_address)] & (PERM_PRESENT|PERM_LARGE_PAGE)) != PERM_PRESENT)
+    return 0;
+  uint32 *ptr_page_table;
+  get_page_table(ptr_env->env_page_directory, (void*)virtual_address, &ptr_page_table);
+  return ptr_page_table[PTX(virtual_address)];
+}
+
+//Whether the frame of 'node' is still mapped unmodified by its owner (so its contents are the indexed ones)
+static uint8 merged_frame_is_valid(struct merged_frame *node)
+{
+  if (node->owner->env_status == ENV_FREE)
+    return 0;
+  uint32 entry = page_merging_get_entry(node->owner, node->owner_va);
+  return (entry & (PERM_PRESENT|PERM_MODIFIED)) == PERM_PRESENT
+      && to_frame_info(EXTRACT_ADDRESS(entry)) == node->ptr_frame_info;
+}
+
+//Find another frame with the same contents as the page at 'words' (frame 'ptr_frame_info'),
+//indexed under 'hash' (making its owner's mapping copy-on-write).
+//Else return 'ptr_frame_info' if it's indexed already, NULL if not.
+static struct Frame_Info* page_merging_find_frame(uint32 *words, uint32 hash, struct Frame_Info *ptr_frame_info)
+{
+  uint8 indexed = 0;
+  struct merged_frame **ptr_node = &merged_frames_hash[hash % PAGE_MERGING_HASH_SIZE];
+  while (*ptr_node != NULL)
+  {
+    struct merged_frame *node = *ptr_node;
+    if (!merged_frame_is_valid(node))
+    {
+      *ptr_node = node->next;
+      kmem_cache_free(merged_frames_cache, node);
+      continue;
+    }
+    if (node->ptr_frame_info == ptr_frame_info)
+      indexed = 1;
+    else if (node->hash == hash)
+    {
+      int same = memcmp(words, map_scratch_frame(node->ptr_frame_info, 1), PAGE_SIZE) == 0;
+      unmap_scratch_frame(1);
+      if (same)
+      {
+        if (pt_get_page_permissions(node->owner, node->owner_va) & PERM_WRITEABLE)
+          pt_set_page_permissions(node->owner, node->owner_va, PERM_COW, PERM_WRITEABLE);
+        return node->ptr_frame_info;
+      }
+    }
+    ptr_node = &node->next;
+  }
+  return indexed ? ptr_frame_info : NULL;
+}
+
+//Merge the page at 'virtual_address' of 'ptr_env' with an identical frame if any (return 1),
+//else index it (return 0)
+static uint8 page_merging_scan_page(struct Env *ptr_env, uint32 virtual_address)
+{
+  uint32 entry = page_merging_get_entry(ptr_env, virtual_address);
+  if ((entry & (PERM_PRESENT|PERM_MODIFIED)) != PERM_PRESENT)
+    return 0;
+  struct Frame_Info *ptr_frame_info = to_frame_info(EXTRACT_ADDRESS(entry));
+  //already shared (this includes the zero frame)
+  if (ptr_frame_info->references > 1)
+    return 0;
+
+  uint32 *words = map_scratch_frame(ptr_frame_info, 0);
+  uint32 hash = page_merging_hash(words);
+  struct Frame_Info *ptr_same_frame = NULL;
+  if (hash == page_merging_zero_hash && memcmp(words, ptr_zero_page, PAGE_SIZE) == 0)
+    ptr_same_frame = to_frame_info(STATIC_KERNEL_PHYSICAL_ADDRESS(ptr_zero_page));
+  else
+    ptr_same_frame = page_merging_find_frame(words, hash, ptr_frame_info);
+  unmap_scratch_frame(0);
+
+  if (ptr_same_frame == ptr_frame_info) //indexed by an earlier pass
+    return 0;
+  if (ptr_same_frame == NULL)
+  {
+    struct merged_frame *node = kmem_cache_alloc(merged_frames_cache);
+    if (node == NULL)
+      return 0;
+    node->hash = hash;
+    node->ptr_frame_info = ptr_frame_info;
+    node->owner = ptr_env;
+    node->owner_va = virtual_address;
+    node->next = merged_frames_hash[hash % PAGE_MERGING_HASH_SIZE];
+    merged_frames_hash[hash % PAGE_MERGING_HASH_SIZE] = node;
+    return 0;
+  }
+
+  //(map_frame() frees the frame of the page)
+  uint32 perm = PERM_USER;
+  if (entry & PERM_WRITEABLE)
+    perm |= PERM_COW;
+  map_frame(ptr_env->env_page_directory, ptr_same_frame, (void*)virtual_address, perm);
+  page_merging_frames_saved++;
+  return 1;
+}
+
+static void page_merging_init()
+{
+  if (merged_frames_cache == NULL)
+  {
+    merged_frames_cache = kmem_cache_create("merged_frames", sizeof(struct merged_frame), NULL);
+    page_merging_zero_hash = page_merging_hash((uint32*)ptr_zero_page);
+  }
+}
+
+uint32 page_merging_ticks;
+
+void page_merging_scan()
+{
+  if (!isPageMergingEnabled() || ++page_merging_ticks % PAGE_MERGING_SCAN_INTERVAL != 0)
+    return;
+  page_merging_init();
+
+  int num_scanned = 0, num_skipped = 0, num_merged = 0;
+  while (num_scanned < PAGE_MERGING_SCAN_BATCH && num_skipped < NENV)
+  {
+    struct Env *ptr_env = &envs[page_merging_env_index];
+    if (ptr_env->env_status == ENV_FREE || page_merging_ws_index >= ptr_env->page_WS_max_size)
+    {
+      //next env
+      page_merging_env_index = (page_merging_env_index + 1) % NENV;
+      page_merging_ws_index = 0;
+      num_skipped++;
+      continue;
+    }
+    if (!env_page_ws_is_entry_empty(ptr_env, page_merging_ws_index))
+      num_merged += page_merging_scan_page(ptr_env, env_page_ws_get_virtual_address(ptr_env, page_merging_ws_index));
+    page_merging_ws_index++;
+    num_scanned++;
+  }
+
+  //the merged pages are mapped on other frames
+  if (num_merged > 0)
+    tlbflush();
+}
+
 //
 // Stores address of page table entry in *ptr_page_table .
 // Stores 0 if there is no such entry or on error.
@@ -483,6 +1080,15 @@ void decrement_references(struct Frame_Info* ptr_frame_info)
 
 int get_page_table(uint32 *ptr_page_directory, const void *virtual_address, uint32 **ptr_page_table)
 {
+  //a 4MB page (user heap, or kernel heap span) has no table: 0 is stored (get_frame_info() finds
+  //its frames from the directory entry), the callers that modify entries split it first
+  //(user_large_page_split(), kh_demote_range() for the kernel heap)
+  if (ptr_page_directory[PDX(virtual_address)] & PERM_LARGE_PAGE)
+  {
+    *ptr_page_table = 0;
+    return TABLE_NOT_EXIST;
+  }
+
   //	cprintf("gpt .05\n");
   uint32 page_directory_entry = ptr_page_directory[PDX(virtual_address)];
 
@@ -533,6 +1139,54 @@ int get_page_table(uint32 *ptr_page_directory, const void *virtual_address, uint
   }
 }
 
+extern void* kzalloc(unsigned int size);
+
+//==================== PAGE TABLES POOL ====================
+// Zeroed kernel heap pages kept ready for create_page_table(), so that a table fault neither
+// searches the kernel heap nor zeroes a page. A table removed by __freeMem_with_buffering()
+// goes back to the pool as it is (it has no used entry, so it's all zeros).
+
+#define PAGE_TABLES_POOL_SIZE 32
+#define PAGE_TABLES_POOL_LOW (PAGE_TABLES_POOL_SIZE / 4)	// the refill starts below it
+#define PAGE_TABLES_REFILL_BATCH 4	// tables allocated per clock tick
+void* page_tables_pool[PAGE_TABLES_POOL_SIZE];
+uint32 page_tables_pool_size;
+uint8 page_tables_refilling;	// went below the low watermark, not full yet
+
+static inline void* get_page_table_page()
+{
+  if (page_tables_pool_size > 0)
+    return page_tables_pool[--page_tables_pool_size];
+  return kzalloc(PAGE_SIZE);
+}
+
+static inline void put_page_table_page(void *ptr_page_table)
+{
+  if (page_tables_pool_size < PAGE_TABLES_POOL_SIZE)
+    page_tables_pool[page_tables_pool_size++] = ptr_page_table;
+  else
+    kfree(ptr_page_table);
+}
+
+//
+// Allocate up to PAGE_TABLES_REFILL_BATCH zeroed pages into the page tables pool, from when it
+// goes below PAGE_TABLES_POOL_LOW until it's full (nothing while the page daemon is reclaiming).
+// Called on each clock tick, as refill_zeroed_frames_pool().
+//
+void refill_page_tables_pool()
+{
+  void *ptr_page_table;
+  if (page_tables_pool_size < PAGE_TABLES_POOL_LOW)
+    page_tables_refilling = 1;
+  if (!USE_KHEAP || !page_tables_refilling || page_daemon_reclaiming)
+    return;
+  for (int i = 0; i < PAGE_TABLES_REFILL_BATCH && page_tables_pool_size < PAGE_TABLES_POOL_SIZE
+      && (ptr_page_table = kzalloc(PAGE_SIZE)) != NULL; i++)
+    page_tables_pool[page_tables_pool_size++] = ptr_page_table;
+  if (page_tables_pool_size >= PAGE_TABLES_POOL_SIZE)
+    page_tables_refilling = 0;
+}
+
 void * create_page_table(uint32 *ptr_page_directory, const uint32 virtual_address)
 {
   //TODO: [PROJECT 2019 - MS1 - [2] Kernel Dynamic Allocation] create_page_table()
@@ -542,16 +1196,14 @@ void * create_page_table(uint32 *ptr_page_directory, const uint32 virtual_addres
   //	a.	clear all entries (as it may contain garbage data)
   //	b.	clear the TLB cache (using "tlbflush()")
 
-  uint32 page_table_va = (uint32)kmalloc(PAGE_SIZE);
+  //(the page comes already zeroed from the page tables pool if possible, else from kzalloc())
+  uint32 page_table_va = (uint32)get_page_table_page();
   uint32 *meh = (uint32 *) page_table_va;
 
-  uint32 PA = kheap_physical_address(page_table_va);
-
   if(meh ==  NULL)
     return NULL;
-  for(int i = 0; i < 1024; i++){
-    meh[i] = 0;
-  }
+  uint32 PA = kheap_physical_address(page_table_va);
+  page_table_live_entries[PA/PAGE_SIZE] = 0;
   ptr_page_directory[PDX(virtual_address)] |= (PA/PAGE_SIZE)<<12;
   ptr_page_directory[PDX(virtual_address)] |= (PERM_USER|PERM_PRESENT|PERM_WRITEABLE);
 
@@ -560,6 +1212,29 @@ void * create_page_table(uint32 *ptr_page_directory, const uint32 virtual_addres
 }
 
 
+//
+// Set the entry of 'virtual_address' in its page table 'ptr_page_table' (of 'ptr_page_directory')
+// to 'entry', keeping the num of non-empty entries of the table up to date: the table is empty
+// (i.e. can be removed) once page_table_live_entries[] of its frame reaches 0
+//
+static inline void set_page_table_entry(uint32 *ptr_page_directory, uint32 *ptr_page_table, uint32 virtual_address, uint32 entry)
+{
+  uint32 *ptr_entry = &ptr_page_table[PTX(virtual_address)];
+  uint32 table_frame_number = EXTRACT_ADDRESS(ptr_page_directory[PDX(virtual_address)]) / PAGE_SIZE;
+  if (*ptr_entry == 0 && entry != 0)
+    page_table_live_entries[table_frame_number]++;
+  else if (*ptr_entry != 0 && entry == 0)
+    page_table_live_entries[table_frame_number]--;
+  *ptr_entry = entry;
+}
+
+//
+// Return 1 if no entry of the page table of 'virtual_address' is used, else 0
+//
+static inline uint32 page_table_is_empty(uint32 *ptr_page_directory, uint32 virtual_address)
+{
+  return page_table_live_entries[EXTRACT_ADDRESS(ptr_page_directory[PDX(virtual_address)]) / PAGE_SIZE] == 0;
+}
 
 void __static_cpt(uint32 *ptr_page_directory, const uint32 virtual_address, uint32 **ptr_page_table)
 {
@@ -586,6 +1261,7 @@ int map_frame(uint32 *ptr_page_directory, struct Frame_Info *ptr_frame_info, voi
   // Fill this function in
   uint32 physical_address = to_physical_address(ptr_frame_info);
   uint32 *ptr_page_table;
+  user_large_page_split(ptr_page_directory, (uint32)virtual_address);
   if( get_page_table(ptr_page_directory, virtual_address, &ptr_page_table) == TABLE_NOT_EXIST)
   {
     /*==========================================================================================
@@ -640,7 +1316,7 @@ int map_frame(uint32 *ptr_page_directory, struct Frame_Info *ptr_frame_info, voi
       unmap_frame(ptr_page_directory , virtual_address);
   }
   ptr_frame_info->references++;
-  ptr_page_table[PTX(virtual_address)] = CONSTRUCT_ENTRY(physical_address , perm | PERM_PRESENT);
+  set_page_table_entry(ptr_page_directory, ptr_page_table, (uint32)virtual_address, CONSTRUCT_ENTRY(physical_address , perm | PERM_PRESENT));
 
   //ptr_frame_info->va = (uint32)virtual_address;
   return 0;
@@ -659,6 +1335,14 @@ int map_frame(uint32 *ptr_page_directory, struct Frame_Info *ptr_frame_info, voi
 struct Frame_Info * get_frame_info(uint32 *ptr_page_directory, void *virtual_address, uint32 **ptr_page_table)
 {
   // Fill this function in
+  //(a 4MB page, user or kernel heap, has no table: its frame at 'virtual_address' is returned
+  //with no table)
+  uint32 page_directory_entry = ptr_page_directory[PDX(virtual_address)];
+  if (page_directory_entry & PERM_LARGE_PAGE)
+  {
+    *ptr_page_table = 0;
+    return to_frame_info(EXTRACT_ADDRESS(page_directory_entry)) + PTX(virtual_address);
+  }
   //cprintf(".gfi .1\n %x, %x, %x, \n", ptr_page_directory, virtual_address, ptr_page_table);
   uint32 ret =  get_page_table(ptr_page_directory, virtual_address, ptr_page_table) ;
   //cprintf(".gfi .15\n");
@@ -667,7 +1351,8 @@ struct Frame_Info * get_frame_info(uint32 *ptr_page_directory, void *virtual_add
     uint32 index_page_table = PTX(virtual_address);
     //cprintf(".gfi .2\n");
     uint32 page_table_entry = (*ptr_page_table)[index_page_table];
-    if( page_table_entry != 0)
+    //(an entry with no frame can still hold a PERM_ZERO_FILL mark)
+    if( page_table_entry != 0 && EXTRACT_ADDRESS(page_table_entry) != 0)
     {
       //cprintf(".gfi .3\n");
       return to_frame_info( EXTRACT_ADDRESS ( page_table_entry ) );
@@ -695,17 +1380,137 @@ void unmap_frame(uint32 *ptr_page_directory, void *virtual_address)
 {
   // Fill this function in
   uint32 *ptr_page_table;
+  user_large_page_split(ptr_page_directory, (uint32)virtual_address);
   struct Frame_Info* ptr_frame_info = get_frame_info(ptr_page_directory, virtual_address, &ptr_page_table);
   if( ptr_frame_info != 0 )
   {
     if (ptr_frame_info->isBuffered && !CHECK_IF_KERNEL_ADDRESS((uint32)virtual_address))
       cprintf("Freeing BUFFERED frame at va %x!!!\n", virtual_address) ;
     decrement_references(ptr_frame_info);
-    ptr_page_table[PTX(virtual_address)] = 0;
+    set_page_table_entry(ptr_page_directory, ptr_page_table, (uint32)virtual_address, 0);
     tlb_invalidate(ptr_page_directory, virtual_address);
   }
 }
 
+//
+// Invalidates the TLB entries of the "num_pages" pages starting at 'virtual_address',
+// one by one for a short range, else by a single flush of the whole TLB.
+//
+#define MAX_PAGES_TO_INVALIDATE 32
+static inline void invalidate_frame_range(uint32 *ptr_page_directory, uint32 virtual_address, uint32 num_pages)
+{
+  if (num_pages > MAX_PAGES_TO_INVALIDATE)
+  {
+    tlbflush();
+    return;
+  }
+  for (uint32 i = 0; i < num_pages; i++)
+    tlb_invalidate(ptr_page_directory, (void*)(virtual_address + i*PAGE_SIZE));
+}
+
+//
+// Unmaps the frames mapped at the "num_pages" pages starting at 'virtual_address'.
+//
+// Details:
+//   - Same as unmap_frame() for each PRESENT page, but the page table is looked up
+//     once per 4MB chunk (chunks with no page table are skipped).
+//   - The TLB is invalidated once at the end.
+//
+void unmap_frame_range(uint32 *ptr_page_directory, uint32 virtual_address, uint32 num_pages)
+{
+  uint32 *ptr_page_table;
+  uint32 i = 0;
+  while (i < num_pages)
+  {
+    uint32 va = virtual_address + i*PAGE_SIZE;
+    uint32 chunk_pages = 1024 - PTX(va);
+    if (chunk_pages > num_pages - i)
+      chunk_pages = num_pages - i;
+    i += chunk_pages;
+
+    user_large_page_split(ptr_page_directory, va);
+    get_page_table(ptr_page_directory, (void*)va, &ptr_page_table);
+    if (ptr_page_table == NULL)
+      continue;
+    for (uint32 j = PTX(va); j < PTX(va) + chunk_pages; j++)
+    {
+      if ((ptr_page_table[j] & PERM_PRESENT) != PERM_PRESENT)
+        continue;
+      struct Frame_Info* ptr_frame_info = to_frame_info(EXTRACT_ADDRESS(ptr_page_table[j]));
+      if (ptr_frame_info->isBuffered && !CHECK_IF_KERNEL_ADDRESS(va))
+        cprintf("Freeing BUFFERED frame at va %x!!!\n", ROUNDDOWN(va, PTSIZE) + j*PAGE_SIZE) ;
+      decrement_references(ptr_frame_info);
+      ptr_page_table[j] = 0;
+      page_table_live_entries[EXTRACT_ADDRESS(ptr_page_directory[PDX(va)]) / PAGE_SIZE]--;
+    }
+  }
+
+  invalidate_frame_range(ptr_page_directory, virtual_address, num_pages);
+}
+
+//
+// Map the "num_pages" frames of 'ptr_frames' at the consecutive pages starting at
+// 'virtual_address'. The permissions of each entry are set to 'perm|PERM_PRESENT'.
+//
+// Details
+//   - Same as map_frame() for each page, but the page table is looked up (or created)
+//     once per 4MB chunk and its entries are written in bulk.
+//   - The TLB is invalidated once at the end (only if some page was mapped on another frame).
+//
+// RETURNS:
+//   0 on success
+//   E_NO_MEM if a page table can't be created (the pages already mapped by this call are unmapped)
+//
+int map_frame_range(uint32 *ptr_page_directory, struct Frame_Info **ptr_frames, uint32 virtual_address, uint32 num_pages, int perm)
+{
+  uint32 *ptr_page_table;
+  uint32 i = 0, num_replaced = 0;
+  while (i < num_pages)
+  {
+    uint32 va = virtual_address + i*PAGE_SIZE;
+    uint32 chunk_pages = 1024 - PTX(va);
+    if (chunk_pages > num_pages - i)
+      chunk_pages = num_pages - i;
+
+    user_large_page_split(ptr_page_directory, va);
+    if (get_page_table(ptr_page_directory, (void*)va, &ptr_page_table) == TABLE_NOT_EXIST)
+    {
+      if (USE_KHEAP)
+      {
+        ptr_page_table = create_page_table(ptr_page_directory, va);
+      }
+      else
+      {
+        __static_cpt(ptr_page_directory, va, &ptr_page_table);
+      }
+      if (ptr_page_table == NULL)
+      {
+        unmap_frame_range(ptr_page_directory, virtual_address, i);
+        return E_NO_MEM;
+      }
+    }
+
+    for (uint32 j = PTX(va); j < PTX(va) + chunk_pages; j++, i++)
+    {
+      uint32 physical_address = to_physical_address(ptr_frames[i]);
+      //If already mapped: do nothing if on this pa, else unmap it
+      if ((ptr_page_table[j] & PERM_PRESENT) == PERM_PRESENT)
+      {
+        if (EXTRACT_ADDRESS(ptr_page_table[j]) == physical_address)
+          continue;
+        decrement_references(to_frame_info(EXTRACT_ADDRESS(ptr_page_table[j])));
+        num_replaced++;
+      }
+      ptr_frames[i]->references++;
+      set_page_table_entry(ptr_page_directory, ptr_page_table, ROUNDDOWN(va, PTSIZE) + j*PAGE_SIZE, CONSTRUCT_ENTRY(physical_address , perm | PERM_PRESENT));
+    }
+  }
+
+  if (num_replaced > 0)
+    invalidate_frame_range(ptr_page_directory, virtual_address, num_pages);
+  return 0;
+}
+
 
 /*/this function should be called only in the env_create() for creating the page table if not exist
  * (without causing page fault as the normal map_frame())*/
@@ -753,7 +1558,7 @@ int loadtime_map_frame(uint32 *ptr_page_directory, struct Frame_Info *ptr_frame_
   }
 
   ptr_frame_info->references++;
-  ptr_page_table[PTX(virtual_address)] = CONSTRUCT_ENTRY(physical_address , perm | PERM_PRESENT);
+  set_page_table_entry(ptr_page_directory, ptr_page_table, (uint32)virtual_address, CONSTRUCT_ENTRY(physical_address , perm | PERM_PRESENT));
 
   return 0;
 }
@@ -776,11 +1581,23 @@ void allocateMem(struct Env* e, uint32 virtual_address, uint32 size)
   //This function should allocate ALL pages of the required range in the PAGE FILE
   //and allocate NOTHING in the main memory
 
+  //(the page table entries are marked PERM_ZERO_FILL: the pages are never written yet,
+  //so their first read fault maps the shared zero frame instead of reading the page file)
   uint32 required_num_pages = size/PAGE_SIZE + (size % PAGE_SIZE != 0);
   virtual_address = ROUNDDOWN(virtual_address,PAGE_SIZE);
+  uint32 *ptr_page_table = NULL;
   for(int i = 0, va = virtual_address; i < required_num_pages; i++, va += PAGE_SIZE)
   {
     pf_add_empty_env_page(e, va, 0);
+
+    if (i == 0 || PTX(va) == 0)
+    {
+      user_large_page_split(e->env_page_directory, va);
+      if (get_page_table(e->env_page_directory, (void*)va, &ptr_page_table) == TABLE_NOT_EXIST && USE_KHEAP)
+        ptr_page_table = create_page_table(e->env_page_directory, va);
+    }
+    if (ptr_page_table != NULL && ptr_page_table[PTX(va)] == 0)
+      set_page_table_entry(e->env_page_directory, ptr_page_table, va, PERM_ZERO_FILL);
   }
 }
 
@@ -796,45 +1613,65 @@ void __freeMem_with_buffering(struct Env* e, uint32 virtual_address, uint32 size
 {
   //TODO: [PROJECT 2019 - MS2 - [5] User Heap] freeMem() [Kernel Side]
   //This function should:
+	  //("size" is in pages) each table of the range is looked up once per 4MB chunk
 	  uint32 *ptr_table;
 	  virtual_address = ROUNDDOWN(virtual_address,PAGE_SIZE);
-	  for(int i = 0, va = virtual_address; i < size; i++, va += PAGE_SIZE){
-		  	struct Frame_Info *ptr_frame_info = get_frame_info(e->env_page_directory, (void *)va, &ptr_table);
-			int permissions = pt_get_page_permissions(e, va);
-			//3. Free any BUFFERED pages in the given range
-			if((permissions&PERM_BUFFERED) == PERM_BUFFERED){
-				if((permissions&PERM_MODIFIED) == PERM_MODIFIED)
-				  bufferlist_remove_page(&modified_frame_list, ptr_frame_info);
-				else
-				  bufferlist_remove_page(&free_frame_list, ptr_frame_info);
-
-				ptr_frame_info->isBuffered = 0;
-				ptr_frame_info->environment = NULL;
-				free_frame(ptr_frame_info);
-				pt_clear_page_table_entry(e, va);
+	  uint32 end_address = virtual_address + size*PAGE_SIZE;
+	  for(uint32 va = virtual_address, chunk_end; va < end_address; va = chunk_end){
+			chunk_end = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+			if(chunk_end > end_address)
+				chunk_end = end_address;
+
+			//a whole 4MB page is freed at once (a part of it is demoted first)
+			if((e->env_page_directory[PDX(va)] & PERM_LARGE_PAGE) && va == ROUNDDOWN(va, PTSIZE) && chunk_end == va + PTSIZE){
+				user_large_page_free(e, va);
+				ptr_table = NULL;
 			}
-			//2. Free ONLY pages that are resident in the working set from the memory
-			get_page_table(e->env_page_directory,(void*)va, &ptr_table);
-			if((permissions&PERM_PRESENT) == PERM_PRESENT && ptr_table != NULL){
-				unmap_frame(e->env_page_directory, (void*)va);
-				env_page_ws_invalidate(e, va);
+			else{
+				user_large_page_split(e->env_page_directory, va);
+				get_page_table(e->env_page_directory, (void*)va, &ptr_table);
 			}
-			//4. Removes ONLY the empty page tables (i.e. not used) (no pages are mapped in the table)
-			bool ok = 1;
 			if(ptr_table != NULL){
-				for(int j = 0; j < 1024; j++)
-					if(ptr_table[j])
-						ok = 0;
-				if(ok){
-					uint32 physical=e->env_page_directory[PDX(va)];
-					to_frame_info(physical)->references = 0;
-					free_frame(to_frame_info(physical));
+				for(uint32 page_va = va; page_va < chunk_end; page_va += PAGE_SIZE){
+					uint32 entry = ptr_table[PTX(page_va)];
+					//3. Free any BUFFERED pages in the given range
+					if((entry&PERM_BUFFERED) == PERM_BUFFERED){
+						struct Frame_Info *ptr_frame_info = to_frame_info(EXTRACT_ADDRESS(entry));
+						if((entry&PERM_MODIFIED) == PERM_MODIFIED)
+						  bufferlist_remove_page(&modified_frame_list, ptr_frame_info);
+						else
+						  bufferlist_remove_page(&free_frame_list, ptr_frame_info);
+
+						ptr_frame_info->isBuffered = 0;
+						ptr_frame_info->environment = NULL;
+						free_frame(ptr_frame_info);
+						set_page_table_entry(e->env_page_directory, ptr_table, page_va, 0);
+					}
+					//2. Free ONLY pages that are resident in the working set from the memory
+					else if((entry&PERM_PRESENT) == PERM_PRESENT)
+						env_page_ws_invalidate(e, page_va);
+					//never written page: drop its mark
+					else if((entry&PERM_ZERO_FILL) == PERM_ZERO_FILL)
+						set_page_table_entry(e->env_page_directory, ptr_table, page_va, 0);
+				}
+				unmap_frame_range(e->env_page_directory, va, (chunk_end - va)/PAGE_SIZE);
+
+				//4. Removes ONLY the empty page tables (i.e. not used) (no pages are mapped in the table)
+				if(page_table_is_empty(e->env_page_directory, va)){
+					if(USE_KHEAP)
+						put_page_table_page(ptr_table);
+					else{
+						uint32 physical=e->env_page_directory[PDX(va)];
+						to_frame_info(physical)->references = 0;
+						free_frame(to_frame_info(physical));
+					}
 					pd_clear_page_dir_entry(e, va);
 				}
 			}
 
 			//1. Free ALL pages of the given range from the Page File
-			pf_remove_env_page(e, va);
+			for(uint32 page_va = va; page_va < chunk_end; page_va += PAGE_SIZE)
+				pf_remove_env_page(e, page_va);
 	  }
 }
 
@@ -857,6 +1694,55 @@ void moveMem(struct Env* e, uint32 src_virtual_address, uint32 dst_virtual_addre
 //==================================================================================================
 //==================================================================================================
 
+//
+// Range walker: calls 'visit_chunk' once per 4MB chunk of the "num_pages" pages starting at
+// 'virtual_address', with the page table of the chunk (NULL if it doesn't exist, or if the chunk
+// is mapped by a user 4MB page: the visitor checks the directory entry), the va of the first page
+// of the chunk and its num of pages, and returns the sum of what the calls return.
+// So a range is walked per table, and a visitor can skip an absent or empty table in one step.
+// The walk only reads the tables (a 4MB page is never split by it).
+//
+uint32 walk_page_table_range(uint32 *ptr_page_directory, uint32 virtual_address, uint32 num_pages,
+    uint32 (*visit_chunk)(uint32 *ptr_page_directory, uint32 *ptr_page_table, uint32 virtual_address, uint32 num_pages))
+{
+  uint32 *ptr_page_table;
+  uint32 sum = 0, i = 0;
+  while (i < num_pages)
+  {
+    uint32 va = virtual_address + i*PAGE_SIZE;
+    uint32 chunk_pages = 1024 - PTX(va);
+    if (chunk_pages > num_pages - i)
+      chunk_pages = num_pages - i;
+    i += chunk_pages;
+
+    if ((ptr_page_directory[PDX(va)] & PERM_LARGE_PAGE) && !CHECK_IF_KERNEL_ADDRESS(va))
+      ptr_page_table = NULL;
+    else
+      get_page_table(ptr_page_directory, (void*)va, &ptr_page_table);
+    sum += visit_chunk(ptr_page_directory, ptr_page_table, va, chunk_pages);
+  }
+  return sum;
+}
+
+static uint32 count_missing_table(uint32 *ptr_page_directory, uint32 *ptr_page_table, uint32 virtual_address, uint32 num_pages)
+{
+  return ptr_page_table == NULL && !(ptr_page_directory[PDX(virtual_address)] & PERM_LARGE_PAGE);
+}
+
+//(a page is mapped if its entry has a frame, as in get_frame_info(), all pages of a 4MB page are)
+static uint32 count_mapped_pages(uint32 *ptr_page_directory, uint32 *ptr_page_table, uint32 virtual_address, uint32 num_pages)
+{
+  if (ptr_page_directory[PDX(virtual_address)] & PERM_LARGE_PAGE)
+    return num_pages;
+  if (ptr_page_table == NULL || page_table_is_empty(ptr_page_directory, virtual_address))
+    return 0;
+  uint32 num_mapped = 0;
+  for (uint32 j = PTX(virtual_address); j < PTX(virtual_address) + num_pages; j++)
+    if (EXTRACT_ADDRESS(ptr_page_table[j]) != 0)
+      num_mapped++;
+  return num_mapped;
+}
+
 // calculate_required_frames:
 // calculates the new allocatino size required for given address+size,
 // we are not interested in knowing if pages or tables actually exist in memory or the page file,
@@ -864,35 +1750,14 @@ void moveMem(struct Env* e, uint32 src_virtual_address, uint32 dst_virtual_addre
 uint32 calculate_required_frames(uint32* ptr_page_directory, uint32 start_virtual_address, uint32 size)
 {
   LOG_STATMENT(cprintf("calculate_required_frames: Starting at address %x",start_virtual_address));
-  //calculate the required page tables
-  uint32 number_of_tables = 0;
-
-  long i = 0;
-  uint32 current_virtual_address = ROUNDDOWN(start_virtual_address, PAGE_SIZE*1024);
-
-  for(; current_virtual_address < (start_virtual_address+size); current_virtual_address+= PAGE_SIZE*1024)
-  {
-    uint32 *ptr_page_table;
-    get_page_table(ptr_page_directory, (void*) current_virtual_address, &ptr_page_table);
+  uint32 first_va = ROUNDDOWN(start_virtual_address, PAGE_SIZE);
+  uint32 number_of_pages = ROUNDUP(start_virtual_address + size - first_va, PAGE_SIZE) / PAGE_SIZE;
 
-    if(ptr_page_table == 0)
-    {
-      (number_of_tables)++;
-    }
-  }
+  //calculate the required page tables
+  uint32 number_of_tables = walk_page_table_range(ptr_page_directory, first_va, number_of_pages, count_missing_table);
 
   //calc the required page frames
-  uint32 number_of_pages = 0;
-  current_virtual_address = ROUNDDOWN(start_virtual_address, PAGE_SIZE);
-
-  for(; current_virtual_address < (start_virtual_address+size); current_virtual_address+= PAGE_SIZE)
-  {
-    uint32 *ptr_page_table;
-    if (get_frame_info(ptr_page_directory, (void*) current_virtual_address, &ptr_page_table) == 0)
-    {
-      (number_of_pages)++;
-    }
-  }
+  number_of_pages -= walk_page_table_range(ptr_page_directory, first_va, number_of_pages, count_mapped_pages);
 
   //return total number of frames
   LOG_STATMENT(cprintf("calculate_required_frames: Done!"));
@@ -932,50 +1797,170 @@ struct freeFramesCounters calculate_available_frames()
   }
   cprintf("finished loop detction\n");
    */
-  //calculate the free frames from the free frame list
-  struct Frame_Info *ptr;
-  uint32 totalFreeUnBuffered = 0 ;
-  uint32 totalFreeBuffered = 0 ;
-  uint32 totalModified = 0 ;
+  //the counters are kept up to date by the buddy allocator and the buffer lists
+  //(the pre-zeroed frames are free too)
+  struct freeFramesCounters counters = frames_counters;
+  counters.freeNotBuffered += LIST_SIZE(&zeroed_frame_list);
+  return counters;
+}
 
+//2018
+// calculate_free_frames:
+uint32 calculate_free_frames()
+{
+  return frames_counters.freeNotBuffered + frames_counters.freeBuffered + LIST_SIZE(&zeroed_frame_list);
+}
 
-  LIST_FOREACH(ptr, &free_frame_list)
-  {
-    if (ptr->isBuffered)
-      totalFreeBuffered++ ;
-    else
-      totalFreeUnBuffered++ ;
-  }
 
 
+///============================================================================================
+/// Dealing with environment working set
 
-  LIST_FOREACH(ptr, &modified_frame_list)
-  {
-    totalModified++ ;
-  }
+//
+// Index of the page working set of each env (indexed by the env index in "envs"), kept up to date
+// by env_page_ws_set_entry() and env_page_ws_clear_entry():
+//   - a stack of the free entries (free_pos[] is the position of each free entry in it, -1 if used),
+//   - a hash table from the va of each used entry to its index (chained through next[]).
+// It's (re)built from the working set on its first use by an env, or when the env's working set
+// was reallocated, and freed by the page daemon once its env is gone. Without the kernel heap,
+// the working set is scanned instead.
+//
+#define WS_NIL -1
 
+struct ws_index
+{
+  uint32 env_id;
+  void *ptr_ws;
+  uint32 ws_size;
+  int32 *free_stack;
+  int32 *free_pos;
+  uint32 num_free;
+  int32 *heads;
+  int32 *next;
+  uint32 num_heads;
+};
+struct ws_index ws_indexes[NENV];
+
+static inline uint32 ws_index_hash(struct ws_index *ptr_index, uint32 virtual_address)
+{
+  return (virtual_address / PAGE_SIZE) & (ptr_index->num_heads - 1);
+}
 
-  struct freeFramesCounters counters ;
-  counters.freeBuffered = totalFreeBuffered ;
-  counters.freeNotBuffered = totalFreeUnBuffered ;
-  counters.modified = totalModified;
-  return counters;
+static void ws_index_push_free(struct ws_index *ptr_index, uint32 entry_index)
+{
+  ptr_index->free_pos[entry_index] = ptr_index->num_free;
+  ptr_index->free_stack[ptr_index->num_free++] = entry_index;
 }
 
-//2018
-// calculate_free_frames:
-uint32 calculate_free_frames()
+static void ws_index_remove_free(struct ws_index *ptr_index, uint32 entry_index)
+{
+  int32 pos = ptr_index->free_pos[entry_index];
+  int32 last = ptr_index->free_stack[--ptr_index->num_free];
+  ptr_index->free_stack[pos] = last;
+  ptr_index->free_pos[last] = pos;
+  ptr_index->free_pos[entry_index] = WS_NIL;
+}
+
+static void ws_index_link(struct ws_index *ptr_index, uint32 entry_index, uint32 virtual_address)
 {
-  return LIST_SIZE(&free_frame_list);
+  uint32 bucket = ws_index_hash(ptr_index, virtual_address);
+  ptr_index->next[entry_index] = ptr_index->heads[bucket];
+  ptr_index->heads[bucket] = entry_index;
 }
 
+static void ws_index_unlink(struct ws_index *ptr_index, uint32 entry_index, uint32 virtual_address)
+{
+  int32 *ptr_link = &ptr_index->heads[ws_index_hash(ptr_index, virtual_address)];
+  while (*ptr_link != WS_NIL && *ptr_link != entry_index)
+    ptr_link = &ptr_index->next[*ptr_link];
+  if (*ptr_link == entry_index)
+    *ptr_link = ptr_index->next[entry_index];
+}
 
+//Return the index of the working set of 'e', NULL if it can't be allocated
+static struct ws_index* env_page_ws_index(struct Env *e)
+{
+  struct ws_index *ptr_index = &ws_indexes[e - envs];
+  if (ptr_index->ptr_ws == e->ptr_pageWorkingSet && ptr_index->env_id == e->env_id
+      && ptr_index->ws_size == e->page_WS_max_size)
+    return ptr_index;
+  if (!USE_KHEAP)
+    return NULL;
 
-///============================================================================================
-/// Dealing with environment working set
+  if (ptr_index->ptr_ws != NULL)
+    kfree(ptr_index->free_stack);
+  ptr_index->ptr_ws = NULL;
+  uint32 num_heads = 1;
+  while (num_heads < e->page_WS_max_size)
+    num_heads <<= 1;
+  int32 *arrays = kmalloc((3*e->page_WS_max_size + num_heads) * sizeof(int32));
+  if (arrays == NULL)
+    return NULL;
+  ptr_index->free_stack = arrays;
+  ptr_index->free_pos = arrays + e->page_WS_max_size;
+  ptr_index->next = arrays + 2*e->page_WS_max_size;
+  ptr_index->heads = arrays + 3*e->page_WS_max_size;
+  ptr_index->num_heads = num_heads;
+  ptr_index->num_free = 0;
+  for (int i = 0; i < num_heads; i++)
+    ptr_index->heads[i] = WS_NIL;
+  //(free entries pushed from the last one, so that they're taken in order)
+  for (int i = e->page_WS_max_size - 1; i >= 0; i--)
+  {
+    if (e->ptr_pageWorkingSet[i].empty)
+      ws_index_push_free(ptr_index, i);
+    else
+    {
+      ptr_index->free_pos[i] = WS_NIL;
+      ws_index_link(ptr_index, i, ROUNDDOWN(e->ptr_pageWorkingSet[i].virtual_address, PAGE_SIZE));
+    }
+  }
+  ptr_index->env_id = e->env_id;
+  ptr_index->ptr_ws = e->ptr_pageWorkingSet;
+  ptr_index->ws_size = e->page_WS_max_size;
+  return ptr_index;
+}
+
+//
+// Free the indexes of the envs that exited (or whose slot was taken by a new env since).
+// Called by the page daemon every PAGE_DAEMON_SCAN_INTERVAL ticks.
+//
+void env_page_ws_free_index_exited()
+{
+  for (int i = 0; i < NENV; i++)
+  {
+    struct ws_index *ptr_index = &ws_indexes[i];
+    if (ptr_index->ptr_ws == NULL)
+      continue;
+    if (envs[i].env_status != ENV_FREE && envs[i].env_id == ptr_index->env_id)
+      continue;
+    kfree(ptr_index->free_stack);
+    ptr_index->ptr_ws = NULL;
+  }
+}
+
+//
+// Return the index of a free entry of the working set of 'e', -1 if it's full
+//
+int env_page_ws_get_free_entry(struct Env *e)
+{
+  struct ws_index *ptr_index = env_page_ws_index(e);
+  if (ptr_index == NULL)
+  {
+    for (int i = 0; i < e->page_WS_max_size; i++)
+      if (e->ptr_pageWorkingSet[i].empty)
+        return i;
+    return -1;
+  }
+  return ptr_index->num_free > 0 ? ptr_index->free_stack[ptr_index->num_free - 1] : -1;
+}
 
 inline uint32 env_page_ws_get_size(struct Env *e)
 {
+  struct ws_index *ptr_index = env_page_ws_index(e);
+  if (ptr_index != NULL)
+    return e->page_WS_max_size - ptr_index->num_free;
+
   int i=0, counter=0;
   for(;i<e->page_WS_max_size; i++) if(e->ptr_pageWorkingSet[i].empty == 0) counter++;
   return counter;
@@ -983,6 +1968,18 @@ inline uint32 env_page_ws_get_size(struct Env *e)
 
 inline void env_page_ws_invalidate(struct Env* e, uint32 virtual_address)
 {
+  struct ws_index *ptr_index = env_page_ws_index(e);
+  if (ptr_index != NULL)
+  {
+    virtual_address = ROUNDDOWN(virtual_address,PAGE_SIZE);
+    int32 i = ptr_index->heads[ws_index_hash(ptr_index, virtual_address)];
+    while (i != WS_NIL && ROUNDDOWN(e->ptr_pageWorkingSet[i].virtual_address,PAGE_SIZE) != virtual_address)
+      i = ptr_index->next[i];
+    if (i != WS_NIL)
+      env_page_ws_clear_entry(e, i);
+    return;
+  }
+
   int i=0;
   for(;i<e->page_WS_max_size; i++)
   {
@@ -998,6 +1995,15 @@ inline void env_page_ws_set_entry(struct Env* e, uint32 entry_index, uint32 virt
 {
   assert(entry_index >= 0 && entry_index < e->page_WS_max_size);
   assert(virtual_address >= 0 && virtual_address < USER_TOP);
+  struct ws_index *ptr_index = env_page_ws_index(e);
+  if (ptr_index != NULL)
+  {
+    if (e->ptr_pageWorkingSet[entry_index].empty)
+      ws_index_remove_free(ptr_index, entry_index);
+    else
+      ws_index_unlink(ptr_index, entry_index, ROUNDDOWN(e->ptr_pageWorkingSet[entry_index].virtual_address,PAGE_SIZE));
+    ws_index_link(ptr_index, entry_index, ROUNDDOWN(virtual_address,PAGE_SIZE));
+  }
   e->ptr_pageWorkingSet[entry_index].virtual_address = ROUNDDOWN(virtual_address,PAGE_SIZE);
   e->ptr_pageWorkingSet[entry_index].empty = 0;
 
@@ -1009,6 +2015,12 @@ inline void env_page_ws_set_entry(struct Env* e, uint32 entry_index, uint32 virt
 inline void env_page_ws_clear_entry(struct Env* e, uint32 entry_index)
 {
   assert(entry_index >= 0 && entry_index < (e->page_WS_max_size));
+  struct ws_index *ptr_index = env_page_ws_index(e);
+  if (ptr_index != NULL && !e->ptr_pageWorkingSet[entry_index].empty)
+  {
+    ws_index_unlink(ptr_index, entry_index, ROUNDDOWN(e->ptr_pageWorkingSet[entry_index].virtual_address,PAGE_SIZE));
+    ws_index_push_free(ptr_index, entry_index);
+  }
   e->ptr_pageWorkingSet[entry_index].virtual_address = 0;
   e->ptr_pageWorkingSet[entry_index].empty = 1;
   e->ptr_pageWorkingSet[entry_index].time_stamp = 0;
@@ -1227,10 +2239,86 @@ void bufferList_add_page(struct Linked_List* bufferList,struct Frame_Info *ptr_f
   }
    */
   LIST_INSERT_TAIL(bufferList, ptr_frame_info);
+  if (bufferList == &modified_frame_list)
+    frames_counters.modified++;
+  else
+    frames_counters.freeBuffered++;
 }
 void bufferlist_remove_page(struct Linked_List* bufferList, struct Frame_Info *ptr_frame_info)
 {
   LIST_REMOVE(bufferList, ptr_frame_info);
+  if (bufferList == &modified_frame_list)
+    frames_counters.modified--;
+  else
+    frames_counters.freeBuffered--;
+}
+
+//==================== PAGE DAEMON ====================
+// Run on each clock tick (see trap_dispatch()): it writes the modified frames back to the
+// page file of their envs and moves them to the free_frame_list, where they become clean
+// buffered frames that allocate_frame() can reclaim. It's active:
+//   - from when the free frames go below the low watermark until they reach the high one,
+//   - after page_daemon_wakeup() (the modified list is full) until the modified list is empty.
+// At most PAGE_DAEMON_BATCH frames are written per tick, so no fault waits for a whole list.
+
+#define PAGE_DAEMON_LOW_WATERMARK (number_of_frames / 32)
+#define PAGE_DAEMON_HIGH_WATERMARK (number_of_frames / 16)
+#define PAGE_DAEMON_BATCH 32
+#define PAGE_DAEMON_SCAN_INTERVAL 16	// clock ticks between two scans for the state of exited envs
+
+uint8 page_daemon_reclaiming;	// free frames went below the low watermark
+uint8 page_daemon_draining;	// woken up to write back the whole modified list
+uint32 page_daemon_ticks;
+
+void page_daemon_wakeup()
+{
+  page_daemon_draining = 1;
+}
+
+//
+// Write back the given modified frame and move it to the free_frame_list (still buffered)
+//
+void page_daemon_clean_frame(struct Frame_Info *ptr_frame_info)
+{
+  struct Env *ptr_env = ptr_frame_info->environment;
+  pf_update_env_page(ptr_env, (void *)ptr_frame_info->va, ptr_frame_info);
+  pt_set_page_permissions(ptr_env, ptr_frame_info->va, 0, PERM_MODIFIED);
+  bufferlist_remove_page(&modified_frame_list, ptr_frame_info);
+  bufferList_add_page(&free_frame_list, ptr_frame_info);
+}
+
+void page_daemon()
+{
+  if (calculate_free_frames() < PAGE_DAEMON_LOW_WATERMARK)
+    page_daemon_reclaiming = 1;
+
+  //(the exited envs only leave memory behind, their state is freed every few ticks)
+  if (++page_daemon_ticks % PAGE_DAEMON_SCAN_INTERVAL == 0)
+  {
+    user_large_page_free_exited();
+    env_page_ws_free_index_exited();
+  }
+
+  //under memory pressure, the user 4MB pages go back to 4KB pages (one per tick), else a
+  //zeroed block is prepared for them if one was missing
+  if (page_daemon_reclaiming)
+    user_large_page_reclaim();
+  else
+    user_large_page_prepare_block();
+
+  for (int i = 0; i < PAGE_DAEMON_BATCH && (page_daemon_reclaiming || page_daemon_draining); i++)
+  {
+    struct Frame_Info *ptr_frame_info = LIST_FIRST(&modified_frame_list);
+    if (ptr_frame_info == NULL)
+    {
+      //nothing more to write back
+      page_daemon_reclaiming = page_daemon_draining = 0;
+      break;
+    }
+    page_daemon_clean_frame(ptr_frame_info);
+    if (calculate_free_frames() >= PAGE_DAEMON_HIGH_WATERMARK)
+      page_daemon_reclaiming = 0;
+  }
 }
 
 
@@ -1267,7 +2355,12 @@ inline void pt_set_page_permissions(struct Env* ptr_env, uint32 virtual_address,
   //	panic("function pt_set_page_unmodified() called with invalid virtual address\n") ;
 
   uint32 	page_directory_entry = ptr_pgdir[PDX(virtual_address)] ;
-  if ( (page_directory_entry & PERM_PRESENT) == PERM_PRESENT)
+  if (page_directory_entry & PERM_LARGE_PAGE) //4MB page: its permissions are in the directory entry
+  {
+    ptr_pgdir[PDX(virtual_address)] |= (permissions_to_set);
+    ptr_pgdir[PDX(virtual_address)] &= (~permissions_to_clear);
+  }
+  else if ( (page_directory_entry & PERM_PRESENT) == PERM_PRESENT)
   {
     if(USE_KHEAP && !CHECK_IF_KERNEL_ADDRESS(virtual_address))
     {
@@ -1309,6 +2402,7 @@ inline void pt_clear_page_table_entry(struct Env* ptr_env, uint32 virtual_addres
 {
   uint32 * ptr_pgdir = ptr_env->env_page_directory ;
   uint32* ptr_page_table;
+  user_large_page_split(ptr_pgdir, virtual_address);
   //if(get_page_table(ptr_pgdir, (void *)virtual_address, &ptr_page_table) == TABLE_NOT_EXIST)
   //	panic("function pt_set_page_unmodified() called with invalid virtual address\n") ;
 
@@ -1324,7 +2418,7 @@ inline void pt_clear_page_table_entry(struct Env* ptr_env, uint32 virtual_addres
       ptr_page_table = STATIC_KERNEL_VIRTUAL_ADDRESS(EXTRACT_ADDRESS(page_directory_entry)) ;
     }
 
-    ptr_page_table[PTX(virtual_address)] = 0 ;
+    set_page_table_entry(ptr_pgdir, ptr_page_table, virtual_address, 0);
   }
   else if (page_directory_entry != 0) //the table exists but not in main mem, so it must be in sec mem
   {
@@ -1354,7 +2448,11 @@ inline uint32 pt_get_page_permissions(struct Env* ptr_env, uint32 virtual_addres
   uint32* ptr_page_table;
 
   uint32 	page_directory_entry = ptr_pgdir[PDX(virtual_address)] ;
-  if ( (page_directory_entry & PERM_PRESENT) == PERM_PRESENT)
+  if (page_directory_entry & PERM_LARGE_PAGE) //4MB page: its permissions are in the directory entry
+  {
+    return (page_directory_entry & 0x00000FFF);
+  }
+  else if ( (page_directory_entry & PERM_PRESENT) == PERM_PRESENT)
   {
     if(USE_KHEAP && !CHECK_IF_KERNEL_ADDRESS(virtual_address))
     {
@@ -1385,6 +2483,386 @@ inline uint32 pt_get_page_permissions(struct Env* ptr_env, uint32 virtual_addres
   return (ptr_page_table[PTX(virtual_address)] & 0x00000FFF);
 }
 
+//==================== COMPACTION ====================
+// Forms a free block of a given order by migrating the user frames of an aligned block
+// elsewhere. A frame is movable if it's mapped by a single page of a working set (kernel heap
+// frames, page tables, shared and buffered frames are not): it's copied to another frame and
+// the page entry is pointed at the copy (the working set only holds the va, so it stays valid).
+// The movable frames are marked in compaction_movable[] (one bit per frame), the Frame_Info
+// of the frames are left as they are. It's only run by the page daemon, when it prepares a
+// block for the user large pages (see user_large_page_prepare_block()).
+
+#define COMPACTION_IS_MOVABLE(frame_number) (compaction_movable[(frame_number) / 32] & (1 << ((frame_number) % 32)))
+
+//Return 1 if frame 'frame_number' is in a free block of the buddy allocator
+static uint8 compaction_is_free_frame(uint32 frame_number)
+{
+  for (uint32 k = 0; k <= BUDDY_MAX_ORDER; k++)
+    if (buddy_order[frame_number & ~((1 << k) - 1)] == k)
+      return 1;
+  return 0;
+}
+
+//Return the frame mapped by the page 'va' of 'ptr_env' if it's movable, NULL else
+static struct Frame_Info* compaction_movable_frame(struct Env *ptr_env, uint32 va)
+{
+  if (ptr_env->env_page_directory[PDX(va)] & PERM_LARGE_PAGE)
+    return NULL;
+  uint32 *ptr_page_table;
+  struct Frame_Info *ptr_frame_info = get_frame_info(ptr_env->env_page_directory, (void*)va, &ptr_page_table);
+  if (ptr_frame_info == NULL || ptr_frame_info == to_frame_info(STATIC_KERNEL_PHYSICAL_ADDRESS(ptr_zero_page))
+      || ptr_frame_info->isBuffered || ptr_frame_info->references != 1
+      || (ptr_page_table[PTX(va)] & PERM_PRESENT) != PERM_PRESENT)
+    return NULL;
+  return ptr_frame_info;
+}
+
+//Mark the movable frames in compaction_movable[]
+static void compaction_mark_movable_frames()
+{
+  memset(compaction_movable, 0, ROUNDUP(number_of_frames, 32) / 8);
+  for (int i = 0; i < NENV; i++)
+  {
+    struct Env *ptr_env = &envs[i];
+    if (ptr_env->env_status == ENV_FREE)
+      continue;
+    for (uint32 j = 0; j < ptr_env->page_WS_max_size; j++)
+    {
+      if (env_page_ws_is_entry_empty(ptr_env, j))
+        continue;
+      struct Frame_Info *ptr_frame_info = compaction_movable_frame(ptr_env, env_page_ws_get_virtual_address(ptr_env, j));
+      if (ptr_frame_info != NULL)
+      {
+        uint32 frame_number = ptr_frame_info - frames_info;
+        compaction_movable[frame_number / 32] |= (1 << (frame_number % 32));
+      }
+    }
+  }
+}
+
+//Move the page 'va' of 'ptr_env' (mapped on the movable frame 'ptr_frame_info') to a new frame,
+//the old one is left with no references (NOT freed). Return 0, or E_NO_MEM if no free frame is left
+static int compaction_migrate_frame(struct Env *ptr_env, uint32 va, struct Frame_Info *ptr_frame_info)
+{
+  struct Frame_Info *ptr_new_frame;
+  if (allocate_frames(0, &ptr_new_frame) != 0)
+    return E_NO_MEM;
+  memcpy(map_scratch_frame(ptr_new_frame, 0), map_scratch_frame(ptr_frame_info, 1), PAGE_SIZE);
+  unmap_scratch_frame(1);
+  unmap_scratch_frame(0);
+
+  uint32 *ptr_page_table;
+  get_page_table(ptr_env->env_page_directory, (void*)va, &ptr_page_table);
+  set_page_table_entry(ptr_env->env_page_directory, ptr_page_table, va,
+      CONSTRUCT_ENTRY(to_physical_address(ptr_new_frame), pt_get_page_permissions(ptr_env, va)));
+  ptr_new_frame->references = 1;
+  ptr_frame_info->references = 0;
+  return 0;
+}
+
+//Migrate the movable frames of the 'block_size' frames starting at 'block' (their pages are found
+//in the working sets again). Return 0, or E_NO_MEM if no free frame is left
+static int compaction_migrate_block(uint32 block, uint32 block_size)
+{
+  for (int i = 0; i < NENV; i++)
+  {
+    struct Env *ptr_env = &envs[i];
+    if (ptr_env->env_status == ENV_FREE)
+      continue;
+    for (uint32 j = 0; j < ptr_env->page_WS_max_size; j++)
+    {
+      if (env_page_ws_is_entry_empty(ptr_env, j))
+        continue;
+      uint32 va = env_page_ws_get_virtual_address(ptr_env, j);
+      struct Frame_Info *ptr_frame_info = compaction_movable_frame(ptr_env, va);
+      if (ptr_frame_info == NULL || ptr_frame_info - frames_info < block || ptr_frame_info - frames_info >= block + block_size)
+        continue;
+      if (compaction_migrate_frame(ptr_env, va, ptr_frame_info) != 0)
+        return E_NO_MEM;
+    }
+  }
+  return 0;
+}
+
+//
+// Form a free block of 2^order frames by migrating the movable frames of the aligned block
+// that needs the fewest migrations (the block must have no unmovable used frame).
+// It scans all the frames and working sets: it's called by the page daemon only, never on
+// the allocation path (allocate_frames() just fails when no block of the order is free).
+//
+// RETURNS
+//   0 -- on success (the block is free)
+//   E_NO_MEM -- if no block can be freed
+//
+int compact_frames(uint32 order)
+{
+  uint32 block_size = 1 << order;
+  compaction_mark_movable_frames();
+
+  //choose the block
+  uint32 best_block = number_of_frames, best_num_movable = block_size + 1;
+  for (uint32 block = 0; block + block_size <= number_of_frames; block += block_size)
+  {
+    uint32 num_movable = 0, i;
+    for (i = block; i < block + block_size; i++)
+    {
+      if (COMPACTION_IS_MOVABLE(i))
+        num_movable++;
+      else if (!compaction_is_free_frame(i))
+        break;
+    }
+    if (i == block + block_size && num_movable < best_num_movable)
+    {
+      best_block = block;
+      best_num_movable = num_movable;
+    }
+  }
+  if (best_block == number_of_frames || best_num_movable > frames_counters.freeNotBuffered - (block_size - best_num_movable))
+    return E_NO_MEM;
+
+  //take the free parts of the block out of the allocator, so the copies go elsewhere
+  for (uint32 i = best_block; i < best_block + block_size; i++)
+    if (buddy_order[i] != BUDDY_NOT_FREE)
+      buddy_remove_block(i, buddy_order[i]);
+
+  int ret = compaction_migrate_block(best_block, block_size);
+  tlbflush();
+
+  if (ret != 0)
+  {
+    //give back the frames that are free now
+    for (uint32 i = best_block; i < best_block + block_size; i++)
+      if (frames_info[i].references == 0)
+        free_frame(&frames_info[i]);
+    return ret;
+  }
+  free_frames(&frames_info[best_block], order);
+  return 0;
+}
+
+
+//==================== USER LARGE PAGES ====================
+// A 4MB aligned region of the user heap that is allocated but never touched yet is mapped by a
+// single 4MB page (a directory entry with PERM_LARGE_PAGE on a block of 2^10 frames) on its
+// first fault, if the page daemon has a zeroed block ready (it prepares one when a fault found
+// none). It takes one working set entry (its first va), and
+// the pt_* permission functions work on its directory entry, so the replacement handles it as
+// a page. It's demoted to 4KB pages:
+//   - when it's chosen as a victim, and by the page daemon under memory pressure,
+//   - before an entry of its region is modified (user_large_page_split(), e.g. a part of it is
+//     freed or mapped again). The lookups only read its directory entry (get_page_table()
+//     gives no table for it).
+// A demoted page is written to the page file (if it was modified, else it's all zeros) and
+// its frames are freed: its pages are faulted back in one by one.
+
+#define USER_LARGE_PAGE_ORDER 10
+#define MAX_USER_LARGE_PAGES 64
+
+struct user_large_page
+{
+  struct Env *env;
+  uint32 env_id;	// of 'env' when it was mapped (its slot may be reused by another env)
+  uint32 virtual_address;
+  struct Frame_Info *ptr_first_frame;
+};
+struct user_large_page user_large_pages[MAX_USER_LARGE_PAGES];
+uint32 num_user_large_pages;
+uint8 user_large_page_block_wanted;	// a promotion found no block ready (the page daemon prepares one)
+struct Frame_Info *user_large_page_ready_block;	// block prepared by the page daemon for the next promotion...
+uint32 user_large_page_ready_zeroed;	// ...and the num of its frames zeroed so far
+#define USER_LARGE_PAGE_ZERO_BATCH 64	// frames of the block zeroed by the page daemon per tick
+
+static int user_large_page_find(uint32 *ptr_page_directory, uint32 virtual_address)
+{
+  virtual_address = ROUNDDOWN(virtual_address, PTSIZE);
+  for (int i = 0; i < num_user_large_pages; i++)
+    if (user_large_pages[i].env->env_page_directory == ptr_page_directory
+        && user_large_pages[i].env->env_id == user_large_pages[i].env_id
+        && user_large_pages[i].virtual_address == virtual_address)
+      return i;
+  return -1;
+}
+
+//Unmap the 4MB page at index 'index' of user_large_pages and free its frames
+static void user_large_page_remove(int index)
+{
+  struct Env *ptr_env = user_large_pages[index].env;
+  uint32 large_va = user_large_pages[index].virtual_address;
+  uint32 *ptr_pgdir = ptr_env->env_page_directory;
+
+  env_page_ws_invalidate(ptr_env, large_va);
+  ptr_pgdir[PDX(large_va)] = 0;
+  free_frames(user_large_pages[index].ptr_first_frame, USER_LARGE_PAGE_ORDER);
+  user_large_pages[index] = user_large_pages[--num_user_large_pages];
+  tlbflush();
+}
+
+//
+// Map a 4MB page on the 4MB region of 'virtual_address' in the user heap of 'ptr_env', if all
+// of its pages are allocated and never touched (PERM_ZERO_FILL) and a free block is available.
+// RETURNS
+//   0 -- on success (the caller adds the region to the working set by its first va)
+//   E_NO_MEM -- else (the fault is handled on a 4KB page)
+//
+int user_large_page_promote(struct Env *ptr_env, uint32 virtual_address)
+{
+  uint32 *ptr_pgdir = ptr_env->env_page_directory;
+  uint32 large_va = ROUNDDOWN(virtual_address, PTSIZE);
+  if (large_va < USER_HEAP_START || large_va + PTSIZE > USER_HEAP_MAX || num_user_large_pages == MAX_USER_LARGE_PAGES
+      || (ptr_pgdir[PDX(large_va)] & (PERM_PRESENT|PERM_LARGE_PAGE)) != PERM_PRESENT
+      || page_table_live_entries[EXTRACT_ADDRESS(ptr_pgdir[PDX(large_va)]) / PAGE_SIZE] != 1024)
+    return E_NO_MEM;
+
+  uint32 *ptr_page_table;
+  get_page_table(ptr_pgdir, (void*)large_va, &ptr_page_table);
+  for (int i = 0; i < 1024; i++)
+    if (ptr_page_table[i] != PERM_ZERO_FILL)
+      return E_NO_MEM;
+
+  //only take the block zeroed by the page daemon (no compaction nor zeroing on the fault path:
+  //the page daemon is asked to prepare one for the next faults), and not below its high watermark
+  if (calculate_free_frames() < PAGE_DAEMON_HIGH_WATERMARK)
+    return E_NO_MEM;
+  if (user_large_page_ready_block == NULL || user_large_page_ready_zeroed < (1 << USER_LARGE_PAGE_ORDER))
+  {
+    user_large_page_block_wanted = 1;
+    return E_NO_MEM;
+  }
+  struct Frame_Info *ptr_first_frame = user_large_page_ready_block;
+  user_large_page_ready_block = NULL;
+  for (int i = 0; i < (1 << USER_LARGE_PAGE_ORDER); i++)
+    ptr_first_frame[i].references = 1;
+
+  //the table is not needed anymore: clear the marks and give it back to the pool
+  memset(ptr_page_table, 0, PAGE_SIZE);
+  page_table_live_entries[EXTRACT_ADDRESS(ptr_pgdir[PDX(large_va)]) / PAGE_SIZE] = 0;
+  put_page_table_page(ptr_page_table);
+
+  lcr4(rcr4() | CR4_PSE_ENABLE);
+  ptr_pgdir[PDX(large_va)] = CONSTRUCT_ENTRY(to_physical_address(ptr_first_frame), PERM_LARGE_PAGE|PERM_USER|PERM_WRITEABLE|PERM_PRESENT);
+  user_large_pages[num_user_large_pages].env = ptr_env;
+  user_large_pages[num_user_large_pages].env_id = ptr_env->env_id;
+  user_large_pages[num_user_large_pages].virtual_address = large_va;
+  user_large_pages[num_user_large_pages].ptr_first_frame = ptr_first_frame;
+  num_user_large_pages++;
+  tlbflush();
+  return 0;
+}
+
+//
+// Demote the 4MB page mapped at 'virtual_address' in 'ptr_page_directory' to 4KB pages
+// in the page file (see above)
+//
+void user_large_page_demote(uint32 *ptr_page_directory, uint32 virtual_address)
+{
+  int index = user_large_page_find(ptr_page_directory, virtual_address);
+  if (index < 0)
+    panic("user_large_page_demote: no 4MB page is mapped at va %x", virtual_address);
+  struct Env *ptr_env = user_large_pages[index].env;
+  uint32 large_va = user_large_pages[index].virtual_address;
+  uint32 entry = ptr_page_directory[PDX(large_va)];
+  struct Frame_Info *ptr_first_frame = user_large_pages[index].ptr_first_frame;
+
+  if (entry & PERM_MODIFIED)
+  {
+    for (int i = 0; i < 1024; i++)
+    {
+      uint32 va = large_va + i*PAGE_SIZE;
+      if (pf_update_env_page(ptr_env, (void*)va, ptr_first_frame + i) == E_PAGE_NOT_EXIST_IN_PF)
+      {
+        pf_add_empty_env_page(ptr_env, va, 0);
+        pf_update_env_page(ptr_env, (void*)va, ptr_first_frame + i);
+      }
+    }
+  }
+  user_large_page_remove(index);
+
+  //4KB pages from now on (never written ones are marked again)
+  uint32 *ptr_page_table = create_page_table(ptr_page_directory, large_va);
+  if (ptr_page_table != NULL && !(entry & PERM_MODIFIED))
+    for (int i = 0; i < 1024; i++)
+      set_page_table_entry(ptr_page_directory, ptr_page_table, large_va + i*PAGE_SIZE, PERM_ZERO_FILL);
+}
+
+//
+// Demote the user 4MB page of 'virtual_address' in 'ptr_page_directory' if any, before its page
+// table is looked up to be modified
+//
+static inline void user_large_page_split(uint32 *ptr_page_directory, uint32 virtual_address)
+{
+  if ((ptr_page_directory[PDX(virtual_address)] & PERM_LARGE_PAGE) && !CHECK_IF_KERNEL_ADDRESS(virtual_address))
+    user_large_page_demote(ptr_page_directory, virtual_address);
+}
+
+//
+// Free the 4MB page mapped at 'virtual_address' of 'ptr_env' (its whole region is freed)
+//
+void user_large_page_free(struct Env *ptr_env, uint32 virtual_address)
+{
+  int index = user_large_page_find(ptr_env->env_page_directory, virtual_address);
+  if (index >= 0)
+    user_large_page_remove(index);
+}
+
+//
+// Free the 4MB pages of the envs that exited (their directories are gone, so only the blocks
+// are freed). Called by the page daemon every PAGE_DAEMON_SCAN_INTERVAL ticks.
+//
+void user_large_page_free_exited()
+{
+  for (int i = 0; i < num_user_large_pages; )
+  {
+    struct user_large_page *ptr_large_page = &user_large_pages[i];
+    if (ptr_large_page->env->env_status != ENV_FREE && ptr_large_page->env->env_id == ptr_large_page->env_id)
+    {
+      i++;
+      continue;
+    }
+    free_frames(ptr_large_page->ptr_first_frame, USER_LARGE_PAGE_ORDER);
+    *ptr_large_page = user_large_pages[--num_user_large_pages];
+  }
+}
+
+//
+// Prepare a zeroed block for the next promotion if one was wanted: it's allocated (after a
+// compaction if no block is free), then zeroed by USER_LARGE_PAGE_ZERO_BATCH frames per call.
+// Called by the page daemon when it's not reclaiming.
+//
+void user_large_page_prepare_block()
+{
+  if (user_large_page_ready_block == NULL)
+  {
+    if (!user_large_page_block_wanted || calculate_free_frames() < PAGE_DAEMON_HIGH_WATERMARK + (1 << USER_LARGE_PAGE_ORDER))
+      return;
+    user_large_page_block_wanted = 0;
+    if (allocate_frames(USER_LARGE_PAGE_ORDER, &user_large_page_ready_block) != 0
+        && (compact_frames(USER_LARGE_PAGE_ORDER) != 0
+            || allocate_frames(USER_LARGE_PAGE_ORDER, &user_large_page_ready_block) != 0))
+    {
+      user_large_page_ready_block = NULL;
+      return;
+    }
+    user_large_page_ready_zeroed = 0;
+  }
+  for (int i = 0; i < USER_LARGE_PAGE_ZERO_BATCH && user_large_page_ready_zeroed < (1 << USER_LARGE_PAGE_ORDER); i++)
+    zero_frame(user_large_page_ready_block + user_large_page_ready_zeroed++);
+}
+
+//
+// Give back the prepared block, else demote one 4MB page to give its frames back (called by the
+// page daemon under memory pressure)
+//
+void user_large_page_reclaim()
+{
+  user_large_page_free_exited();
+  if (user_large_page_ready_block != NULL)
+  {
+    free_frames(user_large_page_ready_block, USER_LARGE_PAGE_ORDER);
+    user_large_page_ready_block = NULL;
+  }
+  else if (num_user_large_pages > 0)
+    user_large_page_demote(user_large_pages[0].env->env_page_directory, user_large_pages[0].virtual_address);
+}
 
 //=============================================================
 // 2014 - edited in 2017
@@ -1430,6 +2908,23 @@ inline struct Frame_Info* get_frame_from_storage(uint32* frames_storage, uint32
   return ptr_frame_info;
 }
 
+// [3.1] Get the "count" frame infos of the storage of frames starting at the given index
+// (looking up each table of the storage once)
+inline void get_frames_from_storage(uint32* frames_storage, uint32 first_index, uint32 count, struct Frame_Info** ptr_frames)
+{
+  uint32 *ptr_page_table ;
+  for (uint32 index = first_index; index < first_index + count; index++)
+  {
+    uint32 va = index * PAGE_SIZE ;
+    if (index == first_index || PTX(va) == 0)
+      get_page_table(frames_storage, (void*) va, &ptr_page_table);
+    if (ptr_page_table == NULL || ptr_page_table[PTX(va)] == 0)
+      ptr_frames[index - first_index] = NULL;
+    else
+      ptr_frames[index - first_index] = to_frame_info(EXTRACT_ADDRESS(ptr_page_table[PTX(va)]));
+  }
+}
+
 // [4] Clear the storage of frames
 inline void clear_frames_storage(uint32* frames_storage)
 {
@@ -80,14 +80,21 @@ int allocate_semaphore_object(struct Semaphore **allocatedObject)
 		//try to double the size of the "semaphores" array
 		if (USE_KHEAP == 1)
 		{
-			semaphores = (struct Semaphore*) krealloc(semaphores, 2*MAX_SEMAPHORES);
-			if (semaphores == NULL)
+			struct Semaphore* grownSemaphores = (struct Semaphore*) krealloc(semaphores, 2*MAX_SEMAPHORES*sizeof(struct Semaphore));
+			if (grownSemaphores == NULL)
 			{
 				*allocatedObject = NULL;
 				return E_NO_SEMAPHORE;
 			}
 			else
 			{
+				semaphores = grownSemaphores;
+				for (int i = MAX_SEMAPHORES; i < 2*MAX_SEMAPHORES; ++i)
+				{
+					memset(&(semaphores[i]), 0, sizeof(struct Semaphore));
+					semaphores[i].empty = 1;
+					LIST_INIT(&(semaphores[i].env_queue));
+				}
 				semaphoreObjectID = MAX_SEMAPHORES;
 				MAX_SEMAPHORES *= 2;
 			}
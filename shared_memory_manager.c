@@ -61,14 +61,20 @@ int allocate_share_object(struct Share **allocatedObject)
 		//try to increase double the size of the "shares" array
 		if (USE_KHEAP == 1)
 		{
-			shares = krealloc(shares, 2*MAX_SHARES);
-			if (shares == NULL)
+			struct Share* grownShares = krealloc(shares, 2*MAX_SHARES*sizeof(struct Share));
+			if (grownShares == NULL)
 			{
 				*allocatedObject = NULL;
 				return E_NO_SHARE;
 			}
 			else
 			{
+				shares = grownShares;
+				for (int i = MAX_SHARES; i < 2*MAX_SHARES; ++i)
+				{
+					memset(&(shares[i]), 0, sizeof(struct Share));
+					shares[i].empty = 1;
+				}
 				sharedObjectID = MAX_SHARES;
 				MAX_SHARES *= 2;
 			}
@@ -223,6 +229,13 @@ int createSharedObject(int32 ownerID, char* shareName, uint32 size, uint8 isWrit
 //======================
 // [2] Get Share Object:
 //======================
+extern void get_frames_from_storage(uint32* frames_storage, uint32 first_index, uint32 count, struct Frame_Info** ptr_frames);
+extern int map_frame_range(uint32 *ptr_page_directory, struct Frame_Info **ptr_frames, uint32 virtual_address, uint32 num_pages, int perm);
+extern void unmap_frame_range(uint32 *ptr_page_directory, uint32 virtual_address, uint32 num_pages);
+
+#define SHARE_MAP_BATCH 1024
+struct Frame_Info* share_frames[SHARE_MAP_BATCH];
+
 int getSharedObject(int32 ownerID, char* shareName, void* virtual_address)
 {
 	//TODO: [PROJECT 2019 - MS2 - [6] Shared Variables: Get] getSharedObject() [Kernel Side]
@@ -245,17 +258,24 @@ int getSharedObject(int32 ownerID, char* shareName, void* virtual_address)
 	uint32 size = getSizeOfSharedObject(ownerID, shareName);
 	uint32 Obj_frames_num = size/PAGE_SIZE + (size % PAGE_SIZE != 0);
 
-	for(int i = 0, va = (uint32)virtual_address; i < Obj_frames_num; i++, va += PAGE_SIZE){
+	//	(one batch per page table of the storage, so that each table is looked up once)
+	uint32 perm = PERM_USER|PERM_PRESENT;
+	if(shares[ObjID].isWritable == 1)
+		perm |= PERM_WRITEABLE;
+	for(uint32 i = 0; i < Obj_frames_num; i += SHARE_MAP_BATCH){
+		uint32 batch = Obj_frames_num - i;
+		if(batch > SHARE_MAP_BATCH)
+			batch = SHARE_MAP_BATCH;
 		//	2) Get its physical frames from the frames_storage
-		//		(use: get_frame_from_storage())
-		struct Frame_Info *curFrame =  get_frame_from_storage(shares[ObjID].framesStorage, i);
+		//		(use: get_frames_from_storage())
+		get_frames_from_storage(shares[ObjID].framesStorage, i, batch, share_frames);
 
 		//	3) Share these frames with the current environment "myenv" starting from the given "virtual_address"
 		//  4) make sure that read-only object must be shared "read only", use the flag isWritable to make it either read-only or writable
-		if(shares[ObjID].isWritable == 1)
-			map_frame(myenv->env_page_directory, curFrame, (void*)va, PERM_USER|PERM_PRESENT|PERM_WRITEABLE);
-		else
-			map_frame(myenv->env_page_directory, curFrame, (void*)va, PERM_USER|PERM_PRESENT);
+		if(map_frame_range(myenv->env_page_directory, share_frames, (uint32)virtual_address + i*PAGE_SIZE, batch, perm) != 0) {
+			unmap_frame_range(myenv->env_page_directory, (uint32)virtual_address, i);
+			return E_NO_MEM;
+		}
 	}
 	//	5) Update references
 	shares[ObjID].references++;
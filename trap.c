@@ -14,6 +14,16 @@
 #include <kern/trap.h>
 
 extern void __static_cpt(uint32 *ptr_page_directory, const uint32 virtual_address, uint32 **ptr_page_table);
+extern int kheap_lazy_fault(uint32 fault_va);
+extern struct freeFramesCounters frames_counters;
+extern int allocate_zeroed_frame(struct Frame_Info **ptr_frame_info);
+extern void page_daemon();
+extern void refill_zeroed_frames_pool();
+extern void refill_page_tables_pool();
+extern void page_daemon_wakeup();
+extern uint8* ptr_zero_page;
+extern uint8 page_daemon_reclaiming;
+extern int env_page_ws_get_free_entry(struct Env *e);
 
 void __page_fault_handler_with_buffering(struct Env * curenv, uint32 fault_va);
 void page_fault_handler(struct Env * curenv, uint32 fault_va);
@@ -217,12 +227,7 @@ static void trap_dispatch(struct Trapframe *tf)
 	if(tf->tf_trapno == T_PGFLT)
 	{
 		//print_trapframe(tf);
-		if(isPageReplacmentAlgorithmLRU())
-		{
-			//cprintf("===========Table WS before updating time stamp========\n");
-			//env_table_ws_print(curenv) ;
-			update_WS_time_stamps();
-		}
+		//(with LRU, the time stamps are aged on the clock ticks, see page_replacement_sample())
 		fault_handler(tf);
 	}
 	else if (tf->tf_trapno == T_SYSCALL)
@@ -241,6 +246,12 @@ static void trap_dispatch(struct Trapframe *tf)
 	}
 	else if (tf->tf_trapno == IRQ0_Clock)
 	{
+		//(each one only works past its own interval or watermark)
+		page_daemon() ;
+		refill_zeroed_frames_pool() ;
+		refill_page_tables_pool() ;
+		page_merging_scan() ;
+		page_replacement_sample() ;
 		clock_interrupt_handler() ;
 	}
 
@@ -313,11 +324,15 @@ void setPageReplacmentAlgorithmLRU(){_PageRepAlgoType = PG_REP_LRU;}
 void setPageReplacmentAlgorithmCLOCK(){_PageRepAlgoType = PG_REP_CLOCK;}
 void setPageReplacmentAlgorithmFIFO(){_PageRepAlgoType = PG_REP_FIFO;}
 void setPageReplacmentAlgorithmModifiedCLOCK(){_PageRepAlgoType = PG_REP_MODIFIEDCLOCK;}
+void setPageReplacmentAlgorithm2Q(){_PageRepAlgoType = PG_REP_2Q;}
+void setPageReplacmentAlgorithmARC(){_PageRepAlgoType = PG_REP_ARC;}
 
 uint32 isPageReplacmentAlgorithmLRU(){if(_PageRepAlgoType == PG_REP_LRU) return 1; return 0;}
 uint32 isPageReplacmentAlgorithmCLOCK(){if(_PageRepAlgoType == PG_REP_CLOCK) return 1; return 0;}
 uint32 isPageReplacmentAlgorithmFIFO(){if(_PageRepAlgoType == PG_REP_FIFO) return 1; return 0;}
 uint32 isPageReplacmentAlgorithmModifiedCLOCK(){if(_PageRepAlgoType == PG_REP_MODIFIEDCLOCK) return 1; return 0;}
+uint32 isPageReplacmentAlgorithm2Q(){if(_PageRepAlgoType == PG_REP_2Q) return 1; return 0;}
+uint32 isPageReplacmentAlgorithmARC(){if(_PageRepAlgoType == PG_REP_ARC) return 1; return 0;}
 
 void enableModifiedBuffer(uint32 enableIt){_EnableModifiedBuffer = enableIt;}
 uint32 isModifiedBufferEnabled(){  return _EnableModifiedBuffer ; }
@@ -325,6 +340,33 @@ uint32 isModifiedBufferEnabled(){  return _EnableModifiedBuffer ; }
 void enableBuffering(uint32 enableIt){_EnableBuffering = enableIt;}
 uint32 isBufferingEnabled(){  return _EnableBuffering ; }
 
+void enablePageMerging(uint32 enableIt){_EnablePageMerging = enableIt;}
+uint32 isPageMergingEnabled(){  return _EnablePageMerging ; }
+
+//Fault-around window of each env (in pages, 0: disabled), indexed by the env index in "envs"
+//(with the env_id it was set for: a new env in the slot starts disabled)
+uint8 env_fault_around_pages[NENV];
+uint32 env_fault_around_env_id[NENV];
+void setFaultAround(struct Env *e, uint32 numOfPages){
+	env_fault_around_pages[e - envs] = (numOfPages > FAULT_AROUND_MAX_PAGES) ? FAULT_AROUND_MAX_PAGES : numOfPages;
+	env_fault_around_env_id[e - envs] = e->env_id;
+}
+uint32 getFaultAround(struct Env *e){
+	if(env_fault_around_env_id[e - envs] != e->env_id)
+		return 0;
+	return env_fault_around_pages[e - envs] ;
+}
+
+void enableReadahead(uint32 enableIt){_EnableReadahead = enableIt;}
+uint32 isReadaheadEnabled(){  return _EnableReadahead ; }
+
+//Sequential readahead state of each env, indexed by the env index in "envs"
+//(reset when the slot is used by another env_id)
+uint32 env_readahead_env_id[NENV];
+uint32 env_last_read_fault_va[NENV];
+int32 env_last_read_fault_stride[NENV];
+uint8 env_readahead_pages[NENV];
+
 void setModifiedBufferLength(uint32 length) { _ModifiedBufferLength = length;}
 uint32 getModifiedBufferLength() { return _ModifiedBufferLength;}
 
@@ -358,6 +400,11 @@ void detect_modified_loop()
 	cprintf("finished modi loop detection\n");
 }
 
+//Whether the fault being handled is a write (used by the placement of never written pages)
+static uint32 faulted_on_write;
+//Whether a page of the working set is being replaced (then no 4MB page is mapped)
+static uint8 replacing_page;
+
 void fault_handler(struct Trapframe *tf)
 {
 	int userTrap = 0;
@@ -369,10 +416,19 @@ void fault_handler(struct Trapframe *tf)
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
+	faulted_on_write = (tf != NULL && (tf->tf_err & FEC_WR));
 
 	//2017: Check stack overflow for Kernel
 	if (!userTrap)
 	{
+		//Kernel heap page reserved by kmalloc_lazy(): map its frame on first touch
+		if (fault_va >= KERNEL_HEAP_START && fault_va < KERNEL_HEAP_MAX)
+		{
+			if (!kheap_lazy_fault(fault_va))
+				panic("Kernel: invalid kernel heap access at va %x!", fault_va);
+			tlbflush();
+			return;
+		}
 		if (fault_va < KERNEL_STACK_TOP - KERNEL_STACK_SIZE && fault_va >= USER_LIMIT)
 			panic("Kernel: stack overflow exception!");
 	}
@@ -401,6 +457,17 @@ void fault_handler(struct Trapframe *tf)
 		// we have normal page fault =============================================================
 		faulted_env->pageFaultsCounter ++ ;
 
+		//write on a present copy-on-write page: give it its own frame (if no frame is left, a page of
+		//the env goes through replacement to give one back, and the write faults again)
+		if (tf != NULL && (tf->tf_err & FEC_WR)
+				&& (pt_get_page_permissions(faulted_env, fault_va) & (PERM_PRESENT|PERM_COW)) == (PERM_PRESENT|PERM_COW))
+		{
+			if (cow_fault(faulted_env, fault_va) == E_NO_MEM)
+				PFH_remove_victim(faulted_env);
+			tlbflush();
+			return;
+		}
+
 //				cprintf("[%08s] user PAGE fault va %08x\n", curenv->prog_name, fault_va);
 //				cprintf("\nPage working set BEFORE fault handler...\n");
 //				env_page_ws_print(curenv);
@@ -455,8 +522,8 @@ void __page_fault_handler_with_buffering(struct Env * curenv, uint32 fault_va)
 	if(env_page_ws_get_size(curenv) < curenv->page_WS_max_size) //no replacement needed, just add the page to the working set
 		PFH_placement(curenv, fault_va);
 
-	else if (isPageReplacmentAlgorithmModifiedCLOCK())
-		PFH_replacement_MC(curenv, fault_va);
+	else //the victim is chosen by the selected replacement policy
+		PFH_replacement(curenv, fault_va);
 
 	//TODO: [PROJECT 2019 - BONUS6] Change WS Size according to “Program Priority”
 }
@@ -479,45 +546,192 @@ void PFH_placement(struct Env *curenv, uint32 fault_va){
 
 		fault_resolved = 1;
 	}
+	else if(page_permissions & PERM_ZERO_FILL){ //page never written: no need to read it from the page file
+		struct Frame_Info *ptr_frame_info;
+		//a whole untouched 4MB heap region: map it by a 4MB page (not while replacing, or a demoted region would be promoted back)
+		if(!replacing_page && user_large_page_promote(curenv, fault_va) == 0)
+			fault_va = ROUNDDOWN(fault_va, PTSIZE);
+		else if(faulted_on_write){
+			allocate_zeroed_frame(&ptr_frame_info);
+			map_frame(curenv->env_page_directory, ptr_frame_info, (void *)fault_va, PERM_PRESENT|PERM_USER|PERM_WRITEABLE);
+		}
+		else //share the zero frame until the first write (copy-on-write)
+			map_frame(curenv->env_page_directory, to_frame_info(STATIC_KERNEL_PHYSICAL_ADDRESS(ptr_zero_page)), (void *)fault_va, PERM_PRESENT|PERM_USER|PERM_COW);
+		fault_resolved = 1;
+	}
 	else{ //page is not buffered
-		uint32 *ptr_page_table;
-		struct Frame_Info *ptr_frame_info = get_frame_info(curenv->env_page_directory, (void *)fault_va, &ptr_page_table);
-
-		allocate_frame(&ptr_frame_info);
+		struct Frame_Info *ptr_frame_info;
+		//a stack page may be a new one (not in the page file) that must read as zeros: it gets a
+		//pre-zeroed frame from the start (overwritten by the page file if the page is there)
+		uint8 stack_page = (fault_va >= USTACKBOTTOM && fault_va < USTACKTOP);
+		int allocated = stack_page ? allocate_zeroed_frame(&ptr_frame_info) : allocate_frame(&ptr_frame_info);
+		if(allocated != 0)
+			panic("PFH_placement: no free frame for the faulted page\n");
 		map_frame(curenv->env_page_directory, ptr_frame_info, (void *)fault_va, PERM_PRESENT|PERM_USER|PERM_WRITEABLE);
 
 		int read_from_page_file = pf_read_env_page(curenv, (void *)fault_va);
 		if(read_from_page_file == E_PAGE_NOT_EXIST_IN_PF){ //page doesn't exist in page file
-			if(fault_va >= USTACKBOTTOM && fault_va < USTACKTOP){ //stack page
+			if(stack_page){ //new stack page
 				int add_to_page_file = pf_add_empty_env_page(curenv, fault_va, 1);
 				if(add_to_page_file != E_NO_PAGE_FILE_SPACE)
 					fault_resolved = 1;
 			}
 		}
-		else //page exists in page file
+		else{ //page exists in page file
 			fault_resolved = 1;
+			if(isReadaheadEnabled())
+				PFH_readahead(curenv, fault_va);
+		}
 	}
 
 	if(fault_resolved){ //update working set
-		int index = curenv->page_last_WS_index;
-		for(int i = 0; i < curenv->page_WS_max_size; i++){
-			uint32 cur_VA = curenv->ptr_pageWorkingSet[index].virtual_address;
-			if(curenv->ptr_pageWorkingSet[index].empty || !(pt_get_page_permissions(curenv, cur_VA) & PERM_PRESENT)){ //found an empty slot in working set
-				env_page_ws_set_entry(curenv, index, fault_va);
-				curenv->page_last_WS_index = (index + 1)%curenv->page_WS_max_size;
-				break;
-			}
-			index = (index + 1)%curenv->page_WS_max_size;
-		}
+		PFH_add_to_working_set(curenv, fault_va);
+		if(getFaultAround(curenv) > 0 && !replacing_page)
+			PFH_fault_around(curenv, fault_va);
 	}
 	else
 		panic("Illegal memory access!\n");
 }
 
-void PFH_replacement_MC(struct Env *curenv, uint32 fault_va){
-	uint32 victim_VA = MC_getVictimVA(curenv);
+void PFH_add_to_working_set(struct Env *curenv, uint32 va){
+	int index = env_page_ws_get_free_entry(curenv);
+	if(index == -1){ //no free entry: look for an entry whose page isn't present anymore
+		int cur_index = curenv->page_last_WS_index;
+		for(int i = 0; i < curenv->page_WS_max_size && index == -1; i++){
+			if(!(pt_get_page_permissions(curenv, curenv->ptr_pageWorkingSet[cur_index].virtual_address) & PERM_PRESENT))
+				index = cur_index;
+			cur_index = (cur_index + 1)%curenv->page_WS_max_size;
+		}
+		if(index == -1)
+			return;
+	}
+	env_page_ws_set_entry(curenv, index, va);
+	curenv->page_last_WS_index = (index + 1)%curenv->page_WS_max_size;
+	if(get_page_replacement_policy()->on_fault != NULL)
+		get_page_replacement_policy()->on_fault(curenv, index);
+}
+
+//Called on each fault that reads a page from the page file: if the faults of the env follow a
+//constant stride (of at most READAHEAD_MAX_STRIDE pages), the next pages on this stride are read
+//too, as clean buffered pages (so the faults on them don't go to the disk), with the permissions
+//of the faulted page. The num of pages read ahead doubles on each fault of the sequence, up to
+//READAHEAD_MAX_PAGES.
+void PFH_readahead(struct Env *curenv, uint32 fault_va){
+	int env_index = curenv - envs;
+	if(env_readahead_env_id[env_index] != curenv->env_id){ //new env in this slot
+		env_readahead_env_id[env_index] = curenv->env_id;
+		env_last_read_fault_va[env_index] = 0;
+		env_last_read_fault_stride[env_index] = 0;
+		env_readahead_pages[env_index] = 0;
+	}
+	fault_va = ROUNDDOWN(fault_va, PAGE_SIZE);
+	int32 stride = fault_va - env_last_read_fault_va[env_index];
+	int32 max_stride = READAHEAD_MAX_STRIDE*PAGE_SIZE;
+	if(stride != 0 && stride == env_last_read_fault_stride[env_index] && stride <= max_stride && stride >= -max_stride){
+		if(env_readahead_pages[env_index] == 0)
+			env_readahead_pages[env_index] = READAHEAD_MIN_PAGES;
+		else if(env_readahead_pages[env_index] < READAHEAD_MAX_PAGES)
+			env_readahead_pages[env_index] *= 2;
+	}
+	else
+		env_readahead_pages[env_index] = 0;
+	env_last_read_fault_va[env_index] = fault_va;
+	env_last_read_fault_stride[env_index] = stride;
+
+	//no readahead while memory is scarce
+	if(page_daemon_reclaiming)
+		return;
+	uint32 perm = pt_get_page_permissions(curenv, fault_va) & (PERM_USER|PERM_WRITEABLE);
+	uint32 va = fault_va;
+	for(int i = 0; i < env_readahead_pages[env_index]; i++){
+		va += stride;
+		if(va >= USER_TOP || (curenv->env_page_directory[PDX(va)] & (PERM_PRESENT|PERM_LARGE_PAGE)) != PERM_PRESENT)
+			break;
+		uint32 *ptr_page_table;
+		get_page_table(curenv->env_page_directory, (void *)va, &ptr_page_table);
+		if(ptr_page_table[PTX(va)] != 0) //in memory already, or never written
+			continue;
+
+		struct Frame_Info *ptr_frame_info;
+		allocate_frame(&ptr_frame_info);
+		map_frame(curenv->env_page_directory, ptr_frame_info, (void *)va, PERM_PRESENT|PERM_USER|PERM_WRITEABLE);
+		if(pf_read_env_page(curenv, (void *)va) == E_PAGE_NOT_EXIST_IN_PF){
+			unmap_frame(curenv->env_page_directory, (void *)va);
+			break;
+		}
+		ptr_frame_info->isBuffered = 1;
+		ptr_frame_info->environment = curenv;
+		ptr_frame_info->va = va;
+		//(writable for the read, then as the faulted page)
+		pt_set_page_permissions(curenv, va, PERM_BUFFERED, PERM_PRESENT|PERM_MODIFIED|PERM_USED|(PERM_WRITEABLE & ~perm));
+		bufferList_add_page(&free_frame_list, ptr_frame_info);
+	}
+}
+
+//Map the pages around fault_va (in its aligned window of the env's fault-around size, in the same
+//page table) that are in memory already: buffered pages, and never written pages (on the shared
+//zero frame). Only as many as the free slots of the working set.
+void PFH_fault_around(struct Env *curenv, uint32 fault_va){
+	uint32 window = getFaultAround(curenv);
+	uint32 first_va = ROUNDDOWN(fault_va, PAGE_SIZE) - (PTX(fault_va) % window)*PAGE_SIZE;
+	uint32 free_slots = curenv->page_WS_max_size - env_page_ws_get_size(curenv);
+	if((curenv->env_page_directory[PDX(fault_va)] & (PERM_PRESENT|PERM_LARGE_PAGE)) != PERM_PRESENT)
+		return;
+
+	uint32 *ptr_page_table;
+	get_page_table(curenv->env_page_directory, (void *)fault_va, &ptr_page_table);
+	for(uint32 i = 0, va = first_va; i < window && free_slots > 0 && PTX(va) >= PTX(first_va); i++, va += PAGE_SIZE){
+		uint32 page_permissions = ptr_page_table[PTX(va)] & 0xFFF;
+		if(page_permissions & PERM_BUFFERED){
+			struct Frame_Info *ptr_frame_info = to_frame_info(EXTRACT_ADDRESS(ptr_page_table[PTX(va)]));
+			pt_set_page_permissions(curenv, va, PERM_PRESENT, PERM_BUFFERED);
+			ptr_frame_info->isBuffered = 0;
+			if(page_permissions & PERM_MODIFIED)
+				bufferlist_remove_page(&modified_frame_list, ptr_frame_info);
+			else
+				bufferlist_remove_page(&free_frame_list, ptr_frame_info);
+		}
+		else if((page_permissions & PERM_ZERO_FILL) && !(page_permissions & PERM_PRESENT))
+			map_frame(curenv->env_page_directory, to_frame_info(STATIC_KERNEL_PHYSICAL_ADDRESS(ptr_zero_page)), (void *)va, PERM_PRESENT|PERM_USER|PERM_COW);
+		else
+			continue;
+		PFH_add_to_working_set(curenv, va);
+		free_slots--;
+	}
+}
+
+//Remove the victim page of the replacement policy from the working set (buffer it) and place
+//the faulted page instead
+void PFH_replacement(struct Env *curenv, uint32 fault_va){
+	replacing_page = 1;
+	PFH_remove_victim(curenv);
+	PFH_placement(curenv, fault_va);
+	replacing_page = 0;
+}
+
+//Remove the victim page of the replacement policy from the working set of the env (its entry is
+//left free): it's buffered, or written to the page file if it can't be
+void PFH_remove_victim(struct Env *curenv){
+	uint32 victim_VA = get_page_replacement_policy()->select_victim(curenv);
+	env_page_ws_invalidate(curenv, victim_VA);
+	if(pt_get_page_permissions(curenv, victim_VA) & PERM_LARGE_PAGE){ //4MB page: demoted to 4KB pages in the page file
+		user_large_page_demote(curenv->env_page_directory, victim_VA);
+		return;
+	}
 	uint32 *ptr_page_table;
 	struct Frame_Info *ptr_frame_info = get_frame_info(curenv->env_page_directory, (void *)victim_VA, &ptr_page_table);
+	if(ptr_frame_info == to_frame_info(STATIC_KERNEL_PHYSICAL_ADDRESS(ptr_zero_page))){ //never written page: marked again, nothing to write
+		zero_fill_page_unmap(curenv, victim_VA);
+		return;
+	}
+	if(ptr_frame_info->references > 1){ //frame shared copy-on-write with other envs: can't be buffered, drop this mapping
+		if(pf_update_env_page(curenv, (void *)victim_VA, ptr_frame_info) == E_PAGE_NOT_EXIST_IN_PF){
+			pf_add_empty_env_page(curenv, victim_VA, 0);
+			pf_update_env_page(curenv, (void *)victim_VA, ptr_frame_info);
+		}
+		unmap_frame(curenv->env_page_directory, (void *)victim_VA);
+		return;
+	}
 	ptr_frame_info->isBuffered = 1;
 	ptr_frame_info->environment = curenv;
 	ptr_frame_info->va = victim_VA;
@@ -528,20 +742,10 @@ void PFH_replacement_MC(struct Env *curenv, uint32 fault_va){
 		bufferList_add_page(&free_frame_list, ptr_frame_info);
 	else{ //victim page is modified
 		bufferList_add_page(&modified_frame_list, ptr_frame_info);
-		uint32 modifiedList_size = LIST_SIZE(&modified_frame_list);
-		if(modifiedList_size == getModifiedBufferLength()){ //modified list is full, write all pages to page file
-			struct Frame_Info *ptr_modified_frame_info;
-			LIST_FOREACH(ptr_modified_frame_info, &modified_frame_list){
-				uint32 cur_VA = ptr_modified_frame_info->va;
-				pf_update_env_page(curenv, (void *)cur_VA, ptr_modified_frame_info);
-				pt_set_page_permissions(curenv, cur_VA, 0, PERM_MODIFIED);
-				bufferlist_remove_page(&modified_frame_list, ptr_modified_frame_info);
-				bufferList_add_page(&free_frame_list, ptr_modified_frame_info);
-			}
-			cprintf("Updating done, current ML size = %d\n", LIST_SIZE(&modified_frame_list));
-		}
+		uint32 modifiedList_size = frames_counters.modified;
+		if(modifiedList_size >= getModifiedBufferLength()) //modified list is full, the page daemon writes it back to the page file
+			page_daemon_wakeup();
 	}
-	PFH_placement(curenv, fault_va);
 }
 
 uint32 MC_getVictimVA(struct Env *curenv){
@@ -581,3 +785,314 @@ uint32 MC_getVictimVA(struct Env *curenv){
 	}
 	return victim_VA;
 }
+
+//Sampling of the working sets on the clock ticks, for the policies with on_access():
+//PAGE_REPLACEMENT_SAMPLE_BATCH entries every PAGE_REPLACEMENT_SAMPLE_INTERVAL ticks (round robin
+//over the envs), each one is passed to on_access() with its PERM_USED bit, which is then cleared.
+uint32 sample_env_index, sample_ws_index, sample_ticks;
+
+void page_replacement_sample(){
+	struct page_replacement_policy *policy = get_page_replacement_policy();
+	if(policy->on_access == NULL || ++sample_ticks % PAGE_REPLACEMENT_SAMPLE_INTERVAL != 0)
+		return;
+	int num_sampled = 0, num_skipped = 0;
+	while(num_sampled < PAGE_REPLACEMENT_SAMPLE_BATCH && num_skipped < NENV){
+		struct Env *ptr_env = &envs[sample_env_index];
+		if(ptr_env->env_status == ENV_FREE || sample_ws_index >= ptr_env->page_WS_max_size){
+			//next env
+			sample_env_index = (sample_env_index + 1) % NENV;
+			sample_ws_index = 0;
+			num_skipped++;
+			continue;
+		}
+		uint8 used = 0;
+		if(!env_page_ws_is_entry_empty(ptr_env, sample_ws_index)){
+			uint32 cur_VA = env_page_ws_get_virtual_address(ptr_env, sample_ws_index);
+			if(pt_get_page_permissions(ptr_env, cur_VA) & PERM_USED){
+				used = 1;
+				pt_set_page_permissions(ptr_env, cur_VA, 0, PERM_USED);
+			}
+		}
+		policy->on_access(ptr_env, sample_ws_index, used);
+		sample_ws_index++;
+		num_sampled++;
+	}
+}
+
+//State of the policies kept per env (indexed by the env index in "envs"), for the env_id in
+//pr_env_id: a new env in the slot of an old one starts with none of its history
+uint32 pr_env_id[NENV];
+uint32 lru_pass_min_slot[NENV];	//LRU: index+1 of the oldest entry seen by the running pass (0: none)
+uint32 lru_victim_slot[NENV];	//LRU: index+1 of the oldest entry of the last full pass (0: none)
+uint32 pr_ghosts_count[NENV][3];	//2Q, ARC: num of ghosts of each env per list
+uint32 arc_target_recent[NENV];	//ARC: target size of T1
+
+//Return the env index of 'e', after resetting its state if the slot was used by another env before
+static int pr_env_state(struct Env *e){
+	int env_index = e - envs;
+	if(pr_env_id[env_index] != e->env_id){
+		pr_env_id[env_index] = e->env_id;
+		lru_pass_min_slot[env_index] = lru_victim_slot[env_index] = 0;
+		for(int list = 0; list < 3; list++)
+			pr_ghosts_count[env_index][list] = 0;
+		arc_target_recent[env_index] = 0;
+	}
+	return env_index;
+}
+
+//LRU: the time stamps are aged by the sampling: each stamp is shifted right and gets its MSB if
+//the page was used since the last pass. The least recently used entry of the last full pass over
+//a working set is kept as its next victim, so a fault doesn't scan it.
+void LRU_on_access(struct Env *curenv, uint32 ws_index, uint8 used){
+	int env_index = pr_env_state(curenv);
+	if(!env_page_ws_is_entry_empty(curenv, ws_index)){
+		uint32 time_stamp = env_page_ws_get_time_stamp(curenv, ws_index) >> 1;
+		if(used)
+			time_stamp |= 0x80000000;
+		curenv->ptr_pageWorkingSet[ws_index].time_stamp = time_stamp;
+		uint32 min_slot = lru_pass_min_slot[env_index];
+		if(min_slot == 0 || time_stamp < env_page_ws_get_time_stamp(curenv, min_slot - 1))
+			lru_pass_min_slot[env_index] = ws_index + 1;
+	}
+	//the pass over this env is done
+	if(ws_index == curenv->page_WS_max_size - 1){
+		lru_victim_slot[env_index] = lru_pass_min_slot[env_index];
+		lru_pass_min_slot[env_index] = 0;
+	}
+}
+
+uint32 LRU_getVictimVA(struct Env *curenv){
+	int env_index = pr_env_state(curenv);
+	int victim_index = (int)lru_victim_slot[env_index] - 1;
+	lru_victim_slot[env_index] = 0;
+	//the victim of the last pass is gone or used since: take the entry with the oldest stamp
+	if(victim_index < 0 || curenv->ptr_pageWorkingSet[victim_index].empty
+			|| (pt_get_page_permissions(curenv, curenv->ptr_pageWorkingSet[victim_index].virtual_address) & PERM_USED)){
+		victim_index = -1;
+		for(int i = 0; i < curenv->page_WS_max_size; i++){
+			if(curenv->ptr_pageWorkingSet[i].empty)
+				continue;
+			if(victim_index < 0 || curenv->ptr_pageWorkingSet[i].time_stamp < curenv->ptr_pageWorkingSet[victim_index].time_stamp)
+				victim_index = i;
+		}
+	}
+	curenv->page_last_WS_index = victim_index;
+	return curenv->ptr_pageWorkingSet[victim_index].virtual_address;
+}
+
+//CLOCK: second chance to the used pages, from the entry after the last placed one
+uint32 CLOCK_getVictimVA(struct Env *curenv){
+	int index = curenv->page_last_WS_index;
+	while(1){
+		if(!curenv->ptr_pageWorkingSet[index].empty){
+			uint32 cur_VA = curenv->ptr_pageWorkingSet[index].virtual_address;
+			if(!(pt_get_page_permissions(curenv, cur_VA) & PERM_USED)){
+				curenv->page_last_WS_index = index;
+				return cur_VA;
+			}
+			pt_set_page_permissions(curenv, cur_VA, 0, PERM_USED);
+		}
+		index = (index + 1)%curenv->page_WS_max_size;
+	}
+}
+
+//Order of the placements of the faulted pages (FIFO, 2Q and ARC keep it in the time stamps)
+uint32 pr_placement_order;
+
+//FIFO: the free slots are not filled in order (freed entries, fault-around), so the placement
+//order is kept in the time stamp of each entry and the entry with the smallest one is the oldest
+void FIFO_on_fault(struct Env *curenv, uint32 ws_index){
+	curenv->ptr_pageWorkingSet[ws_index].time_stamp = ++pr_placement_order;
+}
+
+uint32 FIFO_getVictimVA(struct Env *curenv){
+	int oldest = -1;
+	for(int i = 0; i < curenv->page_WS_max_size; i++){
+		if(curenv->ptr_pageWorkingSet[i].empty)
+			continue;
+		//(compared as distances from the current order, so the wrap around of the counter is harmless)
+		if(oldest < 0 || pr_placement_order - curenv->ptr_pageWorkingSet[i].time_stamp > pr_placement_order - curenv->ptr_pageWorkingSet[oldest].time_stamp)
+			oldest = i;
+	}
+	curenv->page_last_WS_index = oldest;
+	return curenv->ptr_pageWorkingSet[oldest].virtual_address;
+}
+
+//2Q and ARC keep a page in the "recent" list on its first fault and move it to the "frequent"
+//list when it's referenced again: PR_FREQUENT is set in the time stamp of its entry (the rest
+//of the stamp is the placement order). The pages replaced lately are remembered as ghosts
+//(a direct-mapped table of (env, va), with the list the page was replaced from), so a fault on
+//a page replaced from the recent list is a reference again. The ghosts are tagged with the env_id
+//they belong to, as the rest of the per env state.
+#define PR_FREQUENT 0x80000000
+#define PR_SEEN 0x40000000
+#define PR_ORDER(time_stamp) ((time_stamp) & ~(PR_FREQUENT|PR_SEEN))
+#define PR_GHOST_RECENT 1	//2Q: A1out, ARC: B1
+#define PR_GHOST_FREQUENT 2	//ARC: B2
+#define PR_GHOSTS_SIZE 4096
+
+struct pr_ghost
+{
+	uint32 va;
+	uint32 env_id;
+	uint16 env_slot;	//env index + 1 (0: free)
+	uint8 list;
+};
+struct pr_ghost pr_ghosts[PR_GHOSTS_SIZE];
+
+static struct pr_ghost* pr_ghost_of(struct Env *e, uint32 va){
+	return &pr_ghosts[((va / PAGE_SIZE) ^ ((e - envs) * 2654435761u)) % PR_GHOSTS_SIZE];
+}
+
+static void pr_ghost_add(struct Env *e, uint32 va, uint8 list){
+	int env_index = pr_env_state(e);
+	struct pr_ghost *ptr_ghost = pr_ghost_of(e, va);
+	//(the ghosts of an env that left its slot are not counted anymore)
+	if(ptr_ghost->env_slot != 0 && pr_env_id[ptr_ghost->env_slot - 1] == ptr_ghost->env_id)
+		pr_ghosts_count[ptr_ghost->env_slot - 1][ptr_ghost->list]--;
+	ptr_ghost->va = ROUNDDOWN(va, PAGE_SIZE);
+	ptr_ghost->env_id = e->env_id;
+	ptr_ghost->env_slot = env_index + 1;
+	ptr_ghost->list = list;
+	pr_ghosts_count[env_index][list]++;
+}
+
+//Return the list of the ghost of this page and forget it, 0 if none
+static uint8 pr_ghost_take(struct Env *e, uint32 va){
+	int env_index = pr_env_state(e);
+	struct pr_ghost *ptr_ghost = pr_ghost_of(e, va);
+	if(ptr_ghost->env_slot != env_index + 1 || ptr_ghost->env_id != e->env_id || ptr_ghost->va != ROUNDDOWN(va, PAGE_SIZE))
+		return 0;
+	uint8 list = ptr_ghost->list;
+	pr_ghosts_count[env_index][list]--;
+	ptr_ghost->env_slot = 0;
+	return list;
+}
+
+//Replace the entry 'index' of the working set, which is in the given list
+static uint32 pr_take_victim(struct Env *curenv, int index, uint8 list){
+	uint32 victim_VA = curenv->ptr_pageWorkingSet[index].virtual_address;
+	pr_ghost_add(curenv, victim_VA, list);
+	curenv->page_last_WS_index = index;
+	return victim_VA;
+}
+
+//2Q: A1in (recent) is a FIFO of at most TWOQ_A1IN_PERCENT of the working set, Am (frequent) is
+//replaced by CLOCK. The pages replaced from A1in are remembered in A1out.
+void TWOQ_on_fault(struct Env *curenv, uint32 ws_index){
+	uint32 order = PR_ORDER(++pr_placement_order);
+	if(pr_ghost_take(curenv, curenv->ptr_pageWorkingSet[ws_index].virtual_address) == PR_GHOST_RECENT)
+		order |= PR_FREQUENT;
+	curenv->ptr_pageWorkingSet[ws_index].time_stamp = order;
+}
+
+uint32 TWOQ_getVictimVA(struct Env *curenv){
+	int oldest_recent = -1, num_recent = 0, num_entries = 0;
+	for(int i = 0; i < curenv->page_WS_max_size; i++){
+		if(curenv->ptr_pageWorkingSet[i].empty)
+			continue;
+		num_entries++;
+		uint32 time_stamp = curenv->ptr_pageWorkingSet[i].time_stamp;
+		if(time_stamp & PR_FREQUENT)
+			continue;
+		num_recent++;
+		if(oldest_recent < 0 || PR_ORDER(time_stamp) < PR_ORDER(curenv->ptr_pageWorkingSet[oldest_recent].time_stamp))
+			oldest_recent = i;
+	}
+	if(oldest_recent >= 0 && (num_recent > curenv->page_WS_max_size * TWOQ_A1IN_PERCENT / 100 || num_recent == num_entries))
+		return pr_take_victim(curenv, oldest_recent, PR_GHOST_RECENT);
+
+	//CLOCK over Am
+	int index = curenv->page_last_WS_index;
+	while(1){
+		if(!curenv->ptr_pageWorkingSet[index].empty && (curenv->ptr_pageWorkingSet[index].time_stamp & PR_FREQUENT)){
+			uint32 cur_VA = curenv->ptr_pageWorkingSet[index].virtual_address;
+			if(!(pt_get_page_permissions(curenv, cur_VA) & PERM_USED)){
+				curenv->page_last_WS_index = index;
+				return cur_VA;
+			}
+			pt_set_page_permissions(curenv, cur_VA, 0, PERM_USED);
+		}
+		index = (index + 1)%curenv->page_WS_max_size;
+	}
+}
+
+//ARC, as CLOCK with adaptive replacement: T1 (recent) and T2 (frequent) are replaced by CLOCK,
+//a page of T1 used again after its fault moves to T2 (PR_SEEN marks that the used bit set by the
+//faulting access itself was cleared already). T1 is replaced while it's at least its target size, which grows
+//on the faults on B1 ghosts (replaced from T1) and shrinks on the faults on B2 ghosts.
+void ARC_on_fault(struct Env *curenv, uint32 ws_index){
+	int env_index = pr_env_state(curenv);
+	uint32 order = PR_ORDER(++pr_placement_order);
+	uint32 num_recent_ghosts = pr_ghosts_count[env_index][PR_GHOST_RECENT];
+	uint32 num_frequent_ghosts = pr_ghosts_count[env_index][PR_GHOST_FREQUENT];
+	uint8 list = pr_ghost_take(curenv, curenv->ptr_pageWorkingSet[ws_index].virtual_address);
+	if(list == PR_GHOST_RECENT){
+		uint32 delta = (num_frequent_ghosts > num_recent_ghosts) ? num_frequent_ghosts / num_recent_ghosts : 1;
+		arc_target_recent[env_index] += delta;
+		if(arc_target_recent[env_index] > curenv->page_WS_max_size)
+			arc_target_recent[env_index] = curenv->page_WS_max_size;
+		order |= PR_FREQUENT;
+	}
+	else if(list == PR_GHOST_FREQUENT){
+		uint32 delta = (num_recent_ghosts > num_frequent_ghosts) ? num_recent_ghosts / num_frequent_ghosts : 1;
+		arc_target_recent[env_index] = (arc_target_recent[env_index] > delta) ? arc_target_recent[env_index] - delta : 0;
+		order |= PR_FREQUENT;
+	}
+	curenv->ptr_pageWorkingSet[ws_index].time_stamp = order;
+}
+
+uint32 ARC_getVictimVA(struct Env *curenv){
+	uint32 target = arc_target_recent[pr_env_state(curenv)];
+	uint32 num_recent = 0, num_entries = 0;
+	for(int i = 0; i < curenv->page_WS_max_size; i++){
+		if(curenv->ptr_pageWorkingSet[i].empty)
+			continue;
+		num_entries++;
+		if(!(curenv->ptr_pageWorkingSet[i].time_stamp & PR_FREQUENT))
+			num_recent++;
+	}
+
+	//(each entry is passed at most 4 times: seen, T1 -> T2, used bit cleared, replaced)
+	int index = curenv->page_last_WS_index;
+	for(int i = 0; i < 4*curenv->page_WS_max_size; i++, index = (index + 1)%curenv->page_WS_max_size){
+		if(curenv->ptr_pageWorkingSet[index].empty)
+			continue;
+		uint8 in_recent = !(curenv->ptr_pageWorkingSet[index].time_stamp & PR_FREQUENT);
+		uint8 replace_recent = (num_recent > 0 && (num_recent >= (target > 1 ? target : 1) || num_recent == num_entries));
+		if(in_recent != replace_recent)
+			continue;
+		uint32 cur_VA = curenv->ptr_pageWorkingSet[index].virtual_address;
+		if(pt_get_page_permissions(curenv, cur_VA) & PERM_USED){
+			pt_set_page_permissions(curenv, cur_VA, 0, PERM_USED);
+			if(in_recent && (curenv->ptr_pageWorkingSet[index].time_stamp & PR_SEEN)){
+				curenv->ptr_pageWorkingSet[index].time_stamp |= PR_FREQUENT;
+				num_recent--;
+			}
+			else if(in_recent)
+				curenv->ptr_pageWorkingSet[index].time_stamp |= PR_SEEN;
+			continue;
+		}
+		return pr_take_victim(curenv, index, in_recent ? PR_GHOST_RECENT : PR_GHOST_FREQUENT);
+	}
+	return FIFO_getVictimVA(curenv);
+}
+
+//The replacement policies, selected by setPageReplacmentAlgorithm...()
+struct page_replacement_policy page_replacement_policies[] =
+{
+	{PG_REP_LRU, LRU_getVictimVA, NULL, LRU_on_access},
+	{PG_REP_CLOCK, CLOCK_getVictimVA, NULL, NULL},
+	{PG_REP_FIFO, FIFO_getVictimVA, FIFO_on_fault, NULL},
+	{PG_REP_MODIFIEDCLOCK, MC_getVictimVA, NULL, NULL},
+	{PG_REP_2Q, TWOQ_getVictimVA, TWOQ_on_fault, NULL},
+	{PG_REP_ARC, ARC_getVictimVA, ARC_on_fault, NULL},
+};
+
+struct page_replacement_policy* get_page_replacement_policy(){
+	for(int i = 0; i < sizeof(page_replacement_policies)/sizeof(page_replacement_policies[0]); i++)
+		if(page_replacement_policies[i].type == _PageRepAlgoType)
+			return &page_replacement_policies[i];
+	//modified clock by default
+	return &page_replacement_policies[3];
+}
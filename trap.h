@@ -16,6 +16,8 @@ extern uint8 bypassInstrLength ;
 
 uint32 _EnableModifiedBuffer ;
 uint32 _EnableBuffering ;
+uint32 _EnablePageMerging ;
+uint32 _EnableReadahead ;
 
 
 uint32 _PageRepAlgoType;
@@ -23,6 +25,8 @@ uint32 _PageRepAlgoType;
 #define PG_REP_CLOCK 0x2
 #define PG_REP_FIFO 0x3
 #define PG_REP_MODIFIEDCLOCK  0x4
+#define PG_REP_2Q 0x5
+#define PG_REP_ARC 0x6
 
 void idt_init(void);
 void print_regs(struct PushRegs *regs);
@@ -34,17 +38,86 @@ void setPageReplacmentAlgorithmLRU();
 void setPageReplacmentAlgorithmCLOCK();
 void setPageReplacmentAlgorithmFIFO();
 void setPageReplacmentAlgorithmModifiedCLOCK();
+void setPageReplacmentAlgorithm2Q();
+void setPageReplacmentAlgorithmARC();
 
 uint32 isPageReplacmentAlgorithmLRU();
 uint32 isPageReplacmentAlgorithmCLOCK();
 uint32 isPageReplacmentAlgorithmFIFO();
 uint32 isPageReplacmentAlgorithmModifiedCLOCK();
+uint32 isPageReplacmentAlgorithm2Q();
+uint32 isPageReplacmentAlgorithmARC();
 
 void enableModifiedBuffer(uint32 enableIt);
 uint32 isModifiedBufferEnabled();
 
 //ours
 void PFH_placement(struct Env *, uint32);
-void PFH_replacement_MC(struct Env *, uint32);
+void PFH_replacement(struct Env *, uint32);
+void PFH_remove_victim(struct Env *);
+void PFH_add_to_working_set(struct Env *, uint32);
+void PFH_fault_around(struct Env *, uint32);
+void PFH_readahead(struct Env *, uint32);
+
+//Page replacement policies: select_victim() returns the va of the page to replace (and sets
+//page_last_WS_index on its entry), on_fault() is called when a faulted page is placed at an entry
+//of the working set, on_access() on each entry sampled on the clock ticks (with its PERM_USED)
+struct page_replacement_policy
+{
+	uint32 type;	//PG_REP_...
+	uint32 (*select_victim)(struct Env *);
+	void (*on_fault)(struct Env *, uint32 ws_index);
+	void (*on_access)(struct Env *, uint32 ws_index, uint8 used);
+};
+struct page_replacement_policy* get_page_replacement_policy();
+#define PAGE_REPLACEMENT_SAMPLE_BATCH 64
+#define PAGE_REPLACEMENT_SAMPLE_INTERVAL 4	//clock ticks
+void page_replacement_sample();
 uint32 MC_getVictimVA(struct Env *);
+uint32 LRU_getVictimVA(struct Env *);
+void LRU_on_access(struct Env *, uint32, uint8);
+uint32 CLOCK_getVictimVA(struct Env *);
+uint32 FIFO_getVictimVA(struct Env *);
+void FIFO_on_fault(struct Env *, uint32);
+#define TWOQ_A1IN_PERCENT 25
+uint32 TWOQ_getVictimVA(struct Env *);
+void TWOQ_on_fault(struct Env *, uint32);
+uint32 ARC_getVictimVA(struct Env *);
+void ARC_on_fault(struct Env *, uint32);
+
+//Fault-around: the pages in memory around a faulted page are mapped by the same fault
+#define FAULT_AROUND_MAX_PAGES 64
+void setFaultAround(struct Env *e, uint32 numOfPages);
+uint32 getFaultAround(struct Env *e);
+
+//Sequential readahead from the page file (on the faults that follow a constant stride)
+#define READAHEAD_MIN_PAGES 2
+#define READAHEAD_MAX_PAGES 32
+#define READAHEAD_MAX_STRIDE 16
+void enableReadahead(uint32 enableIt);
+uint32 isReadaheadEnabled();
+
+//Copy-on-write: page shared read-only until its first write fault (an available PTE bit)
+#define PERM_COW 0x400
+//Page allocated but never written yet (entry with no frame): read faults map the shared zero frame
+#define PERM_ZERO_FILL 0x800
+int cow_fault(struct Env *, uint32);
+void zero_fill_page_unmap(struct Env *, uint32);
+uint32 env_share_cow(struct Env *, struct Env *, uint32, uint32);
+
+//Same-page merging (run every few clock ticks when enabled)
+void enablePageMerging(uint32 enableIt);
+uint32 isPageMergingEnabled();
+void page_merging_scan();
+uint32 page_merging_get_frames_saved();
+
+//4MB pages (PSE), for the kernel heap spans (kheap.c) and the user heap
+#define PERM_LARGE_PAGE 0x080	//Page Size bit of a directory entry
+#define CR4_PSE_ENABLE 0x010	//Page Size Extensions bit of cr4
+//Transparent 4MB pages for the user heap
+int user_large_page_promote(struct Env *, uint32);
+void user_large_page_demote(uint32 *, uint32);
+
+//Physical memory compaction: free an aligned block of 2^order frames (0 on success), run by the page daemon
+int compact_frames(uint32 order);
 #endif /* FOS_KERN_TRAP_H */